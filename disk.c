@@ -1,30 +1,743 @@
+// image offsets are 64-bit even where off_t would not be by default
+#define _FILE_OFFSET_BITS 64
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <pthread.h>
+
+#if defined(__linux__) && !defined(DISK_NO_URING) && __has_include(<linux/io_uring.h>)
+#define DISK_HAVE_URING
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 
 #include "disk.h"
 
 #define DISK_MAGIC 0xdeadbeef
 
-static FILE *diskfile;
+// most iovecs handed to a single preadv/pwritev
+#ifdef IOV_MAX
+#define DISK_IOV_MAX IOV_MAX
+#else
+#define DISK_IOV_MAX 1024
+#endif
+
+static int diskfd = -1;
+static char *diskmap;	// the whole image when the mmap backend is in use
 static int nblocks=0;
+static int blocksize=DISK_BLOCK_SIZE;
 static int nreads=0;
 static int nwrites=0;
 
+/*
+Every entry point may be called from several threads at once. One lock
+covers the buffer cache, the list of runs in transfer and the io_uring
+rings, but no transfer is ever made while holding it: a buffer being
+filled or written back is marked busy, and a run going to or from the
+image outside the cache is put on the run list, until the I/O is done.
+Anyone who needs either of those to finish waits on diskcond. The
+counters are only ever bumped atomically.
+*/
+static pthread_mutex_t disklock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t diskcond = PTHREAD_COND_INITIALIZER;
+
+static void disk_sleep();
+
+#define COUNT(counter,n) __atomic_add_fetch(&(counter),(n),__ATOMIC_RELAXED)
+
+/*
+The buffer cache sits between the disk_read/disk_write interface and the
+image file. Buffers are kept on a doubly linked LRU list (most recently used
+at the head) and found through a hash table keyed on block number. Writes only
+dirty a buffer; the block reaches the image when it is evicted or flushed.
+*/
+
+struct disk_buffer {
+	int blocknum;	// -1 when the buffer holds nothing
+	int dirty;
+	int busy;	// being filled from the image or written back to it
+	int prev;	// lru neighbours, -1 at either end
+	int next;
+	int hnext;	// next buffer in the same hash chain
+	char *data;
+};
+
+static int ncache = DISK_CACHE_DEFAULT;
+static struct disk_buffer *cache;
+static char *cachedata;
+static int *hashtable;
+static int nhash;
+static int lruhead = -1;
+static int lrutail = -1;
+static int nhits=0;
+static int nmisses=0;
+
+/*
+A run of blocks read from or written to the image around the cache. While
+it is listed, none of its blocks is evicted or read into a buffer, so the
+cache and the image cannot drift apart underneath the transfer, and no
+other run writing any of the same blocks may start.
+*/
+struct disk_run {
+	int blocknum;
+	int count;
+	int write;
+	struct disk_run *next;
+};
+
+static struct disk_run *runs;
+
+static off_t block_offset( int blocknum )
+{
+	return (off_t)blocknum*blocksize;
+}
+
+// copy one block. the usual sizes get a constant-length memcpy the compiler can inline.
+static inline void block_copy( char *dst, const char *src )
+{
+	switch(blocksize) {
+		case 4096: memcpy(dst,src,4096); break;
+		case 8192: memcpy(dst,src,8192); break;
+		case 16384: memcpy(dst,src,16384); break;
+		case 32768: memcpy(dst,src,32768); break;
+		case 65536: memcpy(dst,src,65536); break;
+		default: memcpy(dst,src,blocksize); break;
+	}
+}
+
+static void io_error()
+{
+	printf("ERROR: couldn't access simulated disk: %s\n",errno ? strerror(errno) : "short transfer");
+	abort();
+}
+
+/*
+The raw_* routines move runs of contiguous blocks with positional I/O, so
+there is no shared file position and one system call covers the whole run.
+Short transfers are resumed; anything else is fatal, as before. With the
+mmap backend they turn into plain memory copies.
+*/
+
+static void raw_read_run( int blocknum, int count, char *data )
+{
+	size_t length = (size_t)count*blocksize;
+	size_t done = 0;
+	ssize_t result;
+
+	if(diskmap) {
+		memcpy(data,&diskmap[block_offset(blocknum)],length);
+		COUNT(nreads,count);
+		return;
+	}
+
+	while(done<length) {
+		errno = 0;
+		result = pread(diskfd,data+done,length-done,block_offset(blocknum)+done);
+		if(result<0 && errno==EINTR) continue;
+		if(result<=0) io_error();
+		done += result;
+	}
+
+	COUNT(nreads,count);
+}
+
+static void raw_write_run( int blocknum, int count, const char *data )
+{
+	size_t length = (size_t)count*blocksize;
+	size_t done = 0;
+	ssize_t result;
+
+	if(diskmap) {
+		memcpy(&diskmap[block_offset(blocknum)],data,length);
+		COUNT(nwrites,count);
+		return;
+	}
+
+	while(done<length) {
+		errno = 0;
+		result = pwrite(diskfd,data+done,length-done,block_offset(blocknum)+done);
+		if(result<0 && errno==EINTR) continue;
+		if(result<=0) io_error();
+		done += result;
+	}
+
+	COUNT(nwrites,count);
+}
+
+// write blocks that are contiguous on disk but scattered in memory in one pwritev
+static void raw_writev_run( int blocknum, struct iovec *iov, int count )
+{
+	size_t length = (size_t)count*blocksize;
+	size_t done = 0;
+	ssize_t result;
+	int first = 0;
+	int i;
+
+	if(diskmap) {
+		for(i=0;i<count;i++) {
+			block_copy(&diskmap[block_offset(blocknum+i)],iov[i].iov_base);
+		}
+		COUNT(nwrites,count);
+		return;
+	}
+
+	while(done<length) {
+		errno = 0;
+		result = pwritev(diskfd,&iov[first],count-first,block_offset(blocknum)+done);
+		if(result<0 && errno==EINTR) continue;
+		if(result<=0) io_error();
+		done += result;
+
+		// step past the iovecs that were completely written, trim a partial one
+		while(first<count && (size_t)result>=iov[first].iov_len) {
+			result -= iov[first].iov_len;
+			first++;
+		}
+		if(first<count) {
+			iov[first].iov_base = (char*)iov[first].iov_base + result;
+			iov[first].iov_len -= result;
+		}
+	}
+
+	COUNT(nwrites,count);
+}
+
+static void raw_read( int blocknum, char *data )
+{
+	raw_read_run(blocknum,1,data);
+}
+
+static void raw_write( int blocknum, const char *data )
+{
+	raw_write_run(blocknum,1,data);
+}
+
+static int hash_block( int blocknum )
+{
+	return (unsigned)blocknum % nhash;
+}
+
+static void lru_unlink( int b )
+{
+	if(cache[b].prev>=0) cache[cache[b].prev].next = cache[b].next;
+	else lruhead = cache[b].next;
+
+	if(cache[b].next>=0) cache[cache[b].next].prev = cache[b].prev;
+	else lrutail = cache[b].prev;
+}
+
+static void lru_push_front( int b )
+{
+	cache[b].prev = -1;
+	cache[b].next = lruhead;
+	if(lruhead>=0) cache[lruhead].prev = b;
+	lruhead = b;
+	if(lrutail<0) lrutail = b;
+}
+
+static void hash_remove( int b )
+{
+	int *link = &hashtable[hash_block(cache[b].blocknum)];
+
+	while(*link!=b) link = &cache[*link].hnext;
+	*link = cache[b].hnext;
+}
+
+static int cache_lookup( int blocknum )
+{
+	int b;
+
+	for(b=hashtable[hash_block(blocknum)];b>=0;b=cache[b].hnext) {
+		if(cache[b].blocknum==blocknum) {
+			lru_unlink(b);
+			lru_push_front(b);
+			return b;
+		}
+	}
+
+	return -1;
+}
+
+// find a buffer without touching the lru order
+static int cache_peek( int blocknum )
+{
+	int b;
+
+	for(b=hashtable[hash_block(blocknum)];b>=0;b=cache[b].hnext) {
+		if(cache[b].blocknum==blocknum) return b;
+	}
+
+	return -1;
+}
+
+// the listed run overlapping [blocknum,blocknum+count), if any; only runs that write count unless all is set
+static struct disk_run *run_find( int blocknum, int count, int all )
+{
+	struct disk_run *r;
+
+	for(r=runs;r;r=r->next) {
+		if((all || r->write) && r->blocknum<blocknum+count && blocknum<r->blocknum+r->count) return r;
+	}
+
+	return 0;
+}
+
+static void run_add( struct disk_run *r, int blocknum, int count, int write )
+{
+	r->blocknum = blocknum;
+	r->count = count;
+	r->write = write;
+	r->next = runs;
+	runs = r;
+}
+
+static void run_remove( struct disk_run *r )
+{
+	struct disk_run **link = &runs;
+
+	while(*link!=r) link = &(*link)->next;
+	*link = r->next;
+	pthread_cond_broadcast(&diskcond);
+}
+
+// may a run start on these blocks? not while a buffer among them is busy, or another run is
+// writing any of them (or, for a write, transferring any of them at all)
+static int run_clear( int blocknum, int count, int write )
+{
+	int i, b;
+
+	if(run_find(blocknum,count,write)) return 0;
+
+	for(i=0;i<count;i++) {
+		b = cache_peek(blocknum+i);
+		if(b>=0 && cache[b].busy) return 0;
+	}
+
+	return 1;
+}
+
+/*
+Take the least recently used buffer that is free to go for blocknum.
+A dirty one is written back first, without the lock, and then the caller
+has to look again (-1), since anything may have happened meanwhile; the
+same goes when every buffer is pinned and it had to wait.
+*/
+static int cache_evict( int blocknum )
+{
+	int b;
+
+	for(b=lrutail;b>=0;b=cache[b].prev) {
+		if(!cache[b].busy && (cache[b].blocknum<0 || !run_find(cache[b].blocknum,1,1))) break;
+	}
+	if(b<0) {
+		disk_sleep();
+		return -1;
+	}
+
+	if(cache[b].blocknum>=0 && cache[b].dirty) {
+		cache[b].busy = 1;
+		cache[b].dirty = 0;
+		pthread_mutex_unlock(&disklock);
+		raw_write(cache[b].blocknum,cache[b].data);
+		pthread_mutex_lock(&disklock);
+		cache[b].busy = 0;
+		pthread_cond_broadcast(&diskcond);
+		return -1;
+	}
+
+	if(cache[b].blocknum>=0) hash_remove(b);
+
+	cache[b].blocknum = blocknum;
+	cache[b].dirty = 0;
+	cache[b].hnext = hashtable[hash_block(blocknum)];
+	hashtable[hash_block(blocknum)] = b;
+
+	lru_unlink(b);
+	lru_push_front(b);
+
+	return b;
+}
+
+static int cache_init()
+{
+	int i;
+
+	if(ncache<=0) return 1;
+
+	nhash = ncache*2+1;
+	cache = calloc(ncache,sizeof(*cache));
+	cachedata = malloc((size_t)ncache*blocksize);
+	hashtable = malloc(nhash*sizeof(int));
+	if(!cache || !cachedata || !hashtable) {
+		free(cache);
+		free(cachedata);
+		free(hashtable);
+		cache = 0;
+		cachedata = 0;
+		hashtable = 0;
+		return 0;
+	}
+
+	for(i=0;i<nhash;i++) hashtable[i] = -1;
+
+	lruhead = lrutail = -1;
+	for(i=0;i<ncache;i++) {
+		cache[i].blocknum = -1;
+		cache[i].data = &cachedata[(size_t)i*blocksize];
+		lru_push_front(i);
+	}
+
+	return 1;
+}
+
+#ifdef DISK_HAVE_URING
+
+struct disk_request {
+	int blocknum;
+	int count;
+	char *data;
+	int write;
+	size_t done;	// bytes already transferred, for resuming short completions
+	int next;	// free list link
+	int *owner;	// pending count of the thread that submitted it
+	struct disk_run run;	// keeps the cache off its blocks until it completes
+};
+
+static int uringdepth = DISK_URING_DEPTH_DEFAULT;
+static int ringfd = -1;
+static void *sqring, *cqring;
+static size_t sqringsize, cqringsize;
+static struct io_uring_sqe *sqes;
+static size_t sqessize;
+static unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+static unsigned *cqhead, *cqtail, *cqmask;
+static struct io_uring_cqe *cqes;
+static struct disk_request *requests;
+static int freerequest = -1;
+static int inflight = 0;
+static int unsubmitted = 0;
+static int reaping = 0;	// a thread is waiting in io_uring_enter for completions
+
+// requests this thread has submitted that have not completed yet
+static __thread int pending = 0;
+
+static int uring_enter( unsigned tosubmit, unsigned mincomplete )
+{
+	int result;
+
+	do {
+		result = syscall(__NR_io_uring_enter,ringfd,tosubmit,mincomplete,mincomplete ? IORING_ENTER_GETEVENTS : 0,NULL,0);
+	} while(result<0 && errno==EINTR);
+
+	if(result<0) io_error();
+	return result;
+}
+
+static void uring_teardown()
+{
+	if(sqes) munmap(sqes,sqessize);
+	if(cqring && cqring!=sqring) munmap(cqring,cqringsize);
+	if(sqring) munmap(sqring,sqringsize);
+	if(ringfd>=0) close(ringfd);
+	free(requests);
+
+	sqes = 0;
+	sqring = cqring = 0;
+	ringfd = -1;
+	requests = 0;
+	freerequest = -1;
+	inflight = 0;
+	unsubmitted = 0;
+	reaping = 0;
+}
+
+static int uring_setup()
+{
+	struct io_uring_params params;
+	unsigned char *sq, *cq;
+	int i;
+
+	memset(&params,0,sizeof(params));
+	ringfd = syscall(__NR_io_uring_setup,uringdepth,&params);
+	if(ringfd<0) return 0;
+
+	sqringsize = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+	cqringsize = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+	if(params.features & IORING_FEAT_SINGLE_MMAP) {
+		if(cqringsize>sqringsize) sqringsize = cqringsize;
+		cqringsize = sqringsize;
+	}
+
+	sqring = mmap(0,sqringsize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ringfd,IORING_OFF_SQ_RING);
+	if(sqring==MAP_FAILED) {
+		sqring = 0;
+		uring_teardown();
+		return 0;
+	}
+
+	if(params.features & IORING_FEAT_SINGLE_MMAP) {
+		cqring = sqring;
+	} else {
+		cqring = mmap(0,cqringsize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ringfd,IORING_OFF_CQ_RING);
+		if(cqring==MAP_FAILED) {
+			cqring = 0;
+			uring_teardown();
+			return 0;
+		}
+	}
+
+	sqessize = params.sq_entries*sizeof(struct io_uring_sqe);
+	sqes = mmap(0,sqessize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ringfd,IORING_OFF_SQES);
+	if(sqes==MAP_FAILED) {
+		sqes = 0;
+		uring_teardown();
+		return 0;
+	}
+
+	sq = sqring;
+	sqhead = (unsigned*)(sq+params.sq_off.head);
+	sqtail = (unsigned*)(sq+params.sq_off.tail);
+	sqmask = (unsigned*)(sq+params.sq_off.ring_mask);
+	sqarray = (unsigned*)(sq+params.sq_off.array);
+
+	cq = cqring;
+	cqhead = (unsigned*)(cq+params.cq_off.head);
+	cqtail = (unsigned*)(cq+params.cq_off.tail);
+	cqmask = (unsigned*)(cq+params.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe*)(cq+params.cq_off.cqes);
+
+	// never keep more requests in flight than the completion ring can hold
+	if((unsigned)uringdepth>params.sq_entries) uringdepth = params.sq_entries;
+
+	requests = calloc(uringdepth,sizeof(*requests));
+	if(!requests) {
+		uring_teardown();
+		return 0;
+	}
+	for(i=0;i<uringdepth;i++) requests[i].next = i+1<uringdepth ? i+1 : -1;
+	freerequest = 0;
+
+	return 1;
+}
+
+// put a request (or what is left of it) on the submission queue
+static void uring_queue( int r )
+{
+	struct disk_request *req = &requests[r];
+	unsigned tail = *sqtail;
+	unsigned index = tail & *sqmask;
+	struct io_uring_sqe *sqe = &sqes[index];
+
+	memset(sqe,0,sizeof(*sqe));
+	sqe->opcode = req->write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = diskfd;
+	sqe->off = block_offset(req->blocknum)+req->done;
+	sqe->addr = (unsigned long)(req->data+req->done);
+	sqe->len = (size_t)req->count*blocksize-req->done;
+	sqe->user_data = r;
+
+	sqarray[index] = index;
+	__atomic_store_n(sqtail,tail+1,__ATOMIC_RELEASE);
+	unsubmitted++;
+}
+
+// take in whatever has completed. called with disklock held
+static void uring_complete()
+{
+	unsigned head, tail;
+
+	head = *cqhead;
+	tail = __atomic_load_n(cqtail,__ATOMIC_ACQUIRE);
+	while(head!=tail) {
+		struct io_uring_cqe *cqe = &cqes[head & *cqmask];
+		int r = cqe->user_data;
+		struct disk_request *req = &requests[r];
+
+		if(cqe->res<0) {
+			errno = -cqe->res;
+			io_error();
+		}
+		if(cqe->res==0) {
+			errno = 0;
+			io_error();
+		}
+
+		req->done += cqe->res;
+		if(req->done<(size_t)req->count*blocksize) {
+			// short transfer: send the rest back round
+			uring_queue(r);
+		} else {
+			if(cache) run_remove(&req->run);
+			req->next = freerequest;
+			freerequest = r;
+			inflight--;
+			__atomic_sub_fetch(req->owner,1,__ATOMIC_RELEASE);
+		}
+
+		head++;
+		tail = __atomic_load_n(cqtail,__ATOMIC_ACQUIRE);
+	}
+	__atomic_store_n(cqhead,head,__ATOMIC_RELEASE);
+}
+
+/*
+Hand queued entries to the kernel and wait for at least one completion.
+Called with disklock held, but it is let go while in io_uring_enter; one
+thread waits there at a time, and the rest wait for it to come back.
+*/
+static void uring_reap()
+{
+	unsigned tosubmit;
+
+	if(reaping) {
+		pthread_cond_wait(&diskcond,&disklock);
+		return;
+	}
+
+	reaping = 1;
+	tosubmit = unsubmitted;
+	unsubmitted = 0;
+	pthread_mutex_unlock(&disklock);
+	uring_enter(tosubmit,1);
+	pthread_mutex_lock(&disklock);
+	reaping = 0;
+
+	uring_complete();
+	pthread_cond_broadcast(&diskcond);
+}
+
+// queue a run; the caller holds disklock, has made sure a request is free and the run may start
+static void uring_submit( int blocknum, int count, char *data, int write )
+{
+	int r;
+
+	r = freerequest;
+	freerequest = requests[r].next;
+	requests[r].blocknum = blocknum;
+	requests[r].count = count;
+	requests[r].data = data;
+	requests[r].write = write;
+	requests[r].done = 0;
+	requests[r].owner = &pending;
+	if(cache) run_add(&requests[r].run,blocknum,count,write);
+	inflight++;
+	pending++;
+
+	uring_queue(r);
+
+	if(write) COUNT(nwrites,count);
+	else COUNT(nreads,count);
+}
+
+#endif
+
+// wait, with disklock held, for a busy buffer or a run to finish. requests on the ring only
+// finish if someone reaps them, so that is done here when they are what is outstanding
+static void disk_sleep()
+{
+#ifdef DISK_HAVE_URING
+	if(ringfd>=0 && inflight>0) {
+		uring_reap();
+		return;
+	}
+#endif
+	pthread_cond_wait(&diskcond,&disklock);
+}
+
+void disk_cache_config( int nbuffers )
+{
+	ncache = nbuffers<0 ? 0 : nbuffers;
+}
+
 int disk_init( const char *filename, int n )
 {
-	diskfile = fopen(filename,"r+");
-	if(!diskfile) diskfile = fopen(filename,"w+");
-	if(!diskfile) return 0;
+	return disk_init_backend(filename,n,DISK_BACKEND_FILE);
+}
+
+void disk_block_size_config( int bytes )
+{
+	blocksize = bytes;
+}
+
+int disk_block_size()
+{
+	return blocksize;
+}
+
+static int block_size_ok( int bytes )
+{
+	return bytes>=DISK_BLOCK_SIZE && bytes<=DISK_MAX_BLOCK_SIZE && !(bytes&(bytes-1));
+}
 
-	ftruncate(fileno(diskfile),n*DISK_BLOCK_SIZE);
+// make the image at least length bytes long. it is never cut short: an image opened with
+// a smaller block size than it was made with would lose its end
+static int image_grow( off_t length )
+{
+	struct stat st;
+
+	if(fstat(diskfd,&st)<0) return 0;
+	if(st.st_size>=length) return 1;
+	return ftruncate(diskfd,length)==0;
+}
+
+int disk_init_backend( const char *filename, int n, int which )
+{
+	if(!block_size_ok(blocksize)) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	diskfd = open(filename,O_RDWR|O_CREAT,0666);
+	if(diskfd<0) return 0;
+
+	if(!image_grow(block_offset(n))) {
+		close(diskfd);
+		diskfd = -1;
+		return 0;
+	}
+
+	diskmap = 0;
+	if(which==DISK_BACKEND_MMAP) {
+		void *map = n>0 ? mmap(0,block_offset(n),PROT_READ|PROT_WRITE,MAP_SHARED,diskfd,0) : MAP_FAILED;
+		if(map==MAP_FAILED) {
+			close(diskfd);
+			diskfd = -1;
+			return 0;
+		}
+		diskmap = map;
+	}
 
 	nblocks = n;
 	nreads = 0;
 	nwrites = 0;
+	nhits = 0;
+	nmisses = 0;
+
+	if(which==DISK_BACKEND_URING) {
+#ifdef DISK_HAVE_URING
+		if(!uring_setup())
+#endif
+		printf("io_uring is not available, using synchronous I/O\n");
+	}
+
+	// a mapped image is already memory, so there is nothing for the cache to save
+	if(!diskmap && !cache_init()) {
+#ifdef DISK_HAVE_URING
+		uring_teardown();
+#endif
+		close(diskfd);
+		diskfd = -1;
+		return 0;
+	}
 
 	return 1;
 }
@@ -34,6 +747,51 @@ int disk_size()
 	return nblocks;
 }
 
+/*
+Switch the open image to another block size, keeping the number of blocks.
+Everything cached is written back and dropped first, and the buffers are
+made again at the new size; if there is no memory for them the disk just
+carries on uncached.
+*/
+int disk_block_size_change( int bytes )
+{
+	int oldsize = blocksize;
+
+	if(!block_size_ok(bytes)) {
+		errno = EINVAL;
+		return 0;
+	}
+	if(bytes==blocksize) return 1;
+
+	disk_flush();
+
+	blocksize = bytes;
+	if(!image_grow(block_offset(nblocks))) {
+		blocksize = oldsize;
+		return 0;
+	}
+
+	if(diskmap) {
+		void *map = nblocks>0 ? mmap(0,block_offset(nblocks),PROT_READ|PROT_WRITE,MAP_SHARED,diskfd,0) : MAP_FAILED;
+		if(map==MAP_FAILED) {
+			blocksize = oldsize;
+			return 0;
+		}
+		munmap(diskmap,(off_t)nblocks*oldsize);
+		diskmap = map;
+	} else {
+		free(cache);
+		free(cachedata);
+		free(hashtable);
+		cache = 0;
+		cachedata = 0;
+		hashtable = 0;
+		cache_init();
+	}
+
+	return 1;
+}
+
 static void sanity_check( int blocknum, const void *data )
 {
 	if(blocknum<0) {
@@ -52,41 +810,370 @@ static void sanity_check( int blocknum, const void *data )
 	}
 }
 
+static void sanity_check_run( int blocknum, int count, const void *data )
+{
+	if(count<=0) {
+		printf("ERROR: block count (%d) is not positive!\n",count);
+		abort();
+	}
+
+	sanity_check(blocknum,data);
+	sanity_check(blocknum+count-1,data);
+}
+
 void disk_read( int blocknum, char *data )
 {
+	int b;
+
 	sanity_check(blocknum,data);
 
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+	if(!cache) {
+		raw_read(blocknum,data);
+		return;
+	}
 
-	if(fread(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nreads++;
-	} else {
-		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
-		abort();
+	pthread_mutex_lock(&disklock);
+	while(1) {
+		b = cache_lookup(blocknum);
+		if(b>=0 && !cache[b].busy) {
+			nhits++;
+			break;
+		}
+		if(b>=0 || run_find(blocknum,1,1)) {
+			disk_sleep();
+			continue;
+		}
+
+		b = cache_evict(blocknum);
+		if(b<0) continue;
+
+		// everyone else wants this block to wait until it is in the buffer
+		nmisses++;
+		cache[b].busy = 1;
+		pthread_mutex_unlock(&disklock);
+		raw_read(blocknum,cache[b].data);
+		pthread_mutex_lock(&disklock);
+		cache[b].busy = 0;
+		pthread_cond_broadcast(&diskcond);
+		break;
 	}
+
+	block_copy(data,cache[b].data);
+	pthread_mutex_unlock(&disklock);
 }
 
 void disk_write( int blocknum, const char *data )
 {
+	int b;
+
 	sanity_check(blocknum,data);
 
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+	if(!cache) {
+		raw_write(blocknum,data);
+		return;
+	}
 
-	if(fwrite(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nwrites++;
-	} else {
-		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
-		abort();
+	// a full-block write never needs the old contents, so a miss just claims a buffer
+	pthread_mutex_lock(&disklock);
+	while(1) {
+		b = cache_lookup(blocknum);
+		if(b>=0 && cache[b].busy) {
+			disk_sleep();
+			continue;
+		}
+		if(b<0) b = cache_evict(blocknum);
+		if(b>=0) break;
+	}
+
+	block_copy(cache[b].data,data);
+	cache[b].dirty = 1;
+	pthread_mutex_unlock(&disklock);
+}
+
+const char *disk_map( int blocknum )
+{
+	if(!diskmap) return 0;
+
+	sanity_check(blocknum,diskmap);
+	COUNT(nreads,1);
+
+	return &diskmap[block_offset(blocknum)];
+}
+
+/*
+Bulk data moves in runs of contiguous blocks and bypasses the cache, so that
+one large file does not flush out the metadata. Buffered copies stay coherent:
+the run is listed for as long as the transfer takes, which keeps its cached
+blocks where they are. A read then takes the newest contents of any of them,
+and a write refreshes them before it starts.
+*/
+
+void disk_read_many( int blocknum, int count, char *data )
+{
+	struct disk_run run;
+	int i, b, ncached=0;
+
+	sanity_check_run(blocknum,count,data);
+
+	if(!cache) {
+		raw_read_run(blocknum,count,data);
+		return;
+	}
+
+	pthread_mutex_lock(&disklock);
+	while(!run_clear(blocknum,count,0)) disk_sleep();
+	run_add(&run,blocknum,count,0);
+	for(i=0;i<count;i++) {
+		if(cache_peek(blocknum+i)>=0) ncached++;
+	}
+	pthread_mutex_unlock(&disklock);
+
+	if(ncached<count) {
+		raw_read_run(blocknum,count,data);
+	}
+
+	// look again afterwards: a block may have been cached (and changed) during the read
+	pthread_mutex_lock(&disklock);
+	for(i=0;i<count;i++) {
+		b = cache_peek(blocknum+i);
+		if(b>=0) {
+			block_copy(&data[(size_t)i*blocksize],cache[b].data);
+			nhits++;
+		} else {
+			nmisses++;
+		}
+	}
+	run_remove(&run);
+	pthread_mutex_unlock(&disklock);
+}
+
+void disk_write_many( int blocknum, int count, const char *data )
+{
+	struct disk_run run;
+	int i, b;
+
+	sanity_check_run(blocknum,count,data);
+
+	if(!cache) {
+		raw_write_run(blocknum,count,data);
+		return;
+	}
+
+	pthread_mutex_lock(&disklock);
+	while(!run_clear(blocknum,count,1)) disk_sleep();
+	run_add(&run,blocknum,count,1);
+	for(i=0;i<count;i++) {
+		b = cache_peek(blocknum+i);
+		if(b>=0) {
+			block_copy(cache[b].data,&data[(size_t)i*blocksize]);
+			cache[b].dirty = 0;
+		}
+	}
+	pthread_mutex_unlock(&disklock);
+
+	raw_write_run(blocknum,count,data);
+
+	pthread_mutex_lock(&disklock);
+	run_remove(&run);
+	pthread_mutex_unlock(&disklock);
+}
+
+/*
+Asynchronous runs. disk_submit_read/disk_submit_write queue a run of
+contiguous blocks and return at once; disk_wait blocks until everything
+queued so far has reached the caller's buffers or the image. With the
+io_uring backend each run becomes one submission queue entry and up to
+uringdepth of them are in flight together. Without a ring (other backends,
+or a kernel that refuses io_uring_setup) a submit simply does the transfer
+on the spot, so callers need not care which they got.
+*/
+
+void disk_uring_config( int depth )
+{
+#ifdef DISK_HAVE_URING
+	uringdepth = depth>0 ? depth : DISK_URING_DEPTH_DEFAULT;
+#endif
+}
+
+void disk_submit_read( int blocknum, int count, char *data )
+{
+	sanity_check_run(blocknum,count,data);
+
+#ifdef DISK_HAVE_URING
+	if(ringfd>=0) {
+		int i;
+
+		pthread_mutex_lock(&disklock);
+		while(freerequest<0 || (cache && !run_clear(blocknum,count,0))) disk_sleep();
+
+		// a cached block may be newer than the image, so let disk_read_many merge it
+		for(i=0;cache && i<count;i++) {
+			if(cache_peek(blocknum+i)>=0) break;
+		}
+		if(!cache || i==count) {
+			if(cache) nmisses += count;
+			uring_submit(blocknum,count,data,0);
+			pthread_mutex_unlock(&disklock);
+			return;
+		}
+		pthread_mutex_unlock(&disklock);
+	}
+#endif
+
+	disk_read_many(blocknum,count,data);
+}
+
+void disk_submit_write( int blocknum, int count, const char *data )
+{
+	sanity_check_run(blocknum,count,data);
+
+#ifdef DISK_HAVE_URING
+	if(ringfd>=0) {
+		int i, b;
+
+		// refresh any cached copies now; the run stays listed until the image catches up
+		pthread_mutex_lock(&disklock);
+		while(freerequest<0 || (cache && !run_clear(blocknum,count,1))) disk_sleep();
+		for(i=0;cache && i<count;i++) {
+			b = cache_peek(blocknum+i);
+			if(b>=0) {
+				block_copy(cache[b].data,&data[(size_t)i*blocksize]);
+				cache[b].dirty = 0;
+			}
+		}
+		uring_submit(blocknum,count,(char*)data,1);
+		pthread_mutex_unlock(&disklock);
+		return;
+	}
+#endif
+
+	disk_write_many(blocknum,count,data);
+}
+
+// wait for this thread's own requests; completions for other threads are reaped along the way
+void disk_wait()
+{
+#ifdef DISK_HAVE_URING
+	if(ringfd<0 || __atomic_load_n(&pending,__ATOMIC_ACQUIRE)==0) return;
+
+	pthread_mutex_lock(&disklock);
+	while(__atomic_load_n(&pending,__ATOMIC_ACQUIRE)>0) {
+		uring_reap();
+	}
+	pthread_mutex_unlock(&disklock);
+#endif
+}
+
+static int compare_blocknum( const void *a, const void *b )
+{
+	return cache[*(const int*)a].blocknum - cache[*(const int*)b].blocknum;
+}
+
+// write back dirty buffers, one pwritev per run of consecutive block numbers
+static void cache_writeback( int *dirty, int n )
+{
+	struct iovec iov[DISK_IOV_MAX];
+	int i, start, count=0;
+
+	for(i=0;i<n;i++) {
+		if(count>0 && (count==DISK_IOV_MAX || cache[dirty[i]].blocknum!=cache[dirty[i-1]].blocknum+1)) {
+			raw_writev_run(cache[dirty[start]].blocknum,iov,count);
+			count = 0;
+		}
+		if(count==0) start = i;
+
+		iov[count].iov_base = cache[dirty[i]].data;
+		iov[count].iov_len = blocksize;
+		count++;
+	}
+
+	if(count>0) raw_writev_run(cache[dirty[start]].blocknum,iov,count);
+}
+
+void disk_flush()
+{
+	int *dirty;
+	int i, n=0;
+
+	if(diskfd<0) return;
+
+	// everything already submitted, by any thread, has to land before the cache is written back
+	pthread_mutex_lock(&disklock);
+#ifdef DISK_HAVE_URING
+	while(ringfd>=0 && inflight>0) {
+		uring_reap();
+	}
+#endif
+
+	if(cache) {
+		// so do buffers already on their way out (a busy one might yet turn out dirty), and
+		// runs still writing a block that is dirty here, or they could land after it
+		for(i=0;i<ncache;i++) {
+			if(cache[i].busy || (cache[i].dirty && run_find(cache[i].blocknum,1,0))) {
+				disk_sleep();
+				i = -1;
+			}
+		}
+
+		dirty = malloc(ncache*sizeof(int));
+		if(dirty) {
+			for(i=0;i<ncache;i++) {
+				if(cache[i].blocknum>=0 && cache[i].dirty) {
+					cache[i].busy = 1;
+					cache[i].dirty = 0;
+					dirty[n++] = i;
+				}
+			}
+
+			// write back in block order so the image file is swept front to back
+			pthread_mutex_unlock(&disklock);
+			qsort(dirty,n,sizeof(int),compare_blocknum);
+			cache_writeback(dirty,n);
+			pthread_mutex_lock(&disklock);
+
+			for(i=0;i<n;i++) cache[dirty[i]].busy = 0;
+			pthread_cond_broadcast(&diskcond);
+			free(dirty);
+		} else {
+			for(i=0;i<ncache;i++) {
+				if(cache[i].blocknum>=0 && cache[i].dirty) {
+					raw_write(cache[i].blocknum,cache[i].data);
+					cache[i].dirty = 0;
+				}
+			}
+		}
 	}
+
+	pthread_mutex_unlock(&disklock);
+
+	if(diskmap) msync(diskmap,block_offset(nblocks),MS_SYNC);
 }
 
 void disk_close()
 {
-	if(diskfile) {
+	if(diskfd>=0) {
+		disk_flush();
 		printf("%d disk block reads\n",nreads);
 		printf("%d disk block writes\n",nwrites);
-		fclose(diskfile);
-		diskfile = 0;
+		if(cache) {
+			printf("%d block cache hits\n",nhits);
+			printf("%d block cache misses\n",nmisses);
+		}
+		if(diskmap) {
+			munmap(diskmap,block_offset(nblocks));
+			diskmap = 0;
+		}
+#ifdef DISK_HAVE_URING
+		uring_teardown();
+#endif
+		close(diskfd);
+		diskfd = -1;
+
+		free(cache);
+		free(cachedata);
+		free(hashtable);
+		cache = 0;
+		cachedata = 0;
+		hashtable = 0;
 	}
 }
-
@@ -1,13 +1,57 @@
 #ifndef DISK_H
 #define DISK_H
 
+// default block size; disk_block_size_config picks any power of two up to DISK_MAX_BLOCK_SIZE
 #define DISK_BLOCK_SIZE 4096
+#define DISK_MAX_BLOCK_SIZE 65536
 
+// ways of reaching the image file, chosen at disk_init_backend
+#define DISK_BACKEND_FILE 0	// positional reads and writes through the buffer cache
+#define DISK_BACKEND_MMAP 1	// the whole image mapped into memory
+#define DISK_BACKEND_URING 2	// like FILE, but disk_submit_* go through io_uring
+
+// number of block buffers cached when disk_cache_config is never called
+#define DISK_CACHE_DEFAULT 64
+
+// requests kept in flight by the io_uring backend unless disk_uring_config says otherwise
+#define DISK_URING_DEPTH_DEFAULT 32
+
+// everything but disk_init*, disk_close and the *_config calls may be used from several threads.
+// disk_wait only waits for the calling thread's own requests.
 int  disk_init( const char *filename, int nblocks );
+int  disk_init_backend( const char *filename, int nblocks, int backend );
 int  disk_size();
+int  disk_block_size();
+
+// switch an open image to another block size, keeping its block count. nothing else may be
+// using the disk meanwhile
+int  disk_block_size_change( int bytes );
+
 void disk_read( int blocknum, char *data );
 void disk_write( int blocknum, const char *data );
+void disk_read_many( int blocknum, int count, char *data );
+void disk_write_many( int blocknum, int count, const char *data );
+void disk_flush();
+
+// queue a run of blocks; the buffer must stay untouched until disk_wait returns
+void disk_submit_read( int blocknum, int count, char *data );
+void disk_submit_write( int blocknum, int count, const char *data );
+void disk_wait();
+
+// read-only view of a block inside a mapped image, or 0 if the backend cannot provide one.
+// the pointer stays good until disk_close and sees later writes to the block.
+const char *disk_map( int blocknum );
+
 void disk_close();
 
+// set the number of cached blocks (0 disables the cache); call before disk_init
+void disk_cache_config( int nbuffers );
+
+// set the io_uring queue depth; call before disk_init_backend
+void disk_uring_config( int depth );
+
+// set the bytes per block for the image; call before disk_init. fs_mount switches to the
+// size an existing filesystem was formatted with
+void disk_block_size_config( int bytes );
 
 #endif
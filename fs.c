@@ -1,581 +1,4608 @@
 
 #include "fs.h"
 #include "disk.h"
+#include "lz.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
-
-int *bitmap;
-int sizeBitmap;
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
 
 #define FS_MAGIC           0xf0f03410
-#define INODES_PER_BLOCK   128
+#define FS_VERSION         5	// 2: 64-bit file sizes, double and triple indirect blocks; 3: lazily zeroed inode blocks;
+				// 4: 256-byte inodes that can hold a small file's data; 5: per-block reference counts
+#define INODES_PER_BLOCK   128	// version 1 inodes in a 4096-byte block, the only size version 1 knows
+#define INODES_PER_BLOCK_V2 (BLOCK_SIZE / (int)sizeof(struct fs_inode_v2))
+#define INODES_PER_BLOCK_V4 (BLOCK_SIZE / (int)sizeof(struct fs_inode_v4))
+#define INODE_INLINE_MAX   240	// bytes of file data a version 4 inode holds in place of its pointers
 #define POINTERS_PER_INODE 5
-#define POINTERS_PER_BLOCK 1024
-#define BLOCK_SIZE 4096
+#define POINTERS_PER_BLOCK (BLOCK_SIZE / (int)sizeof(int))
+#define BLOCK_SIZE         (fs.blocksize)	// the disk's block size, recorded in the superblock at format time
+#define MAX_BLOCK_SIZE     DISK_MAX_BLOCK_SIZE
+#define MAX_POINTERS_PER_BLOCK (MAX_BLOCK_SIZE / (int)sizeof(int))
+#define MAX_FILE_BLOCKS    (POINTERS_PER_INODE + POINTERS_PER_BLOCK)
+#define BITS_PER_BLOCK     (BLOCK_SIZE * 8)
+#define WORDS_PER_BLOCK    (BLOCK_SIZE / 8)
+
+#define READAHEAD_SLOTS      8	// inodes whose access pattern we follow at once
+#define READAHEAD_MIN_WINDOW 4	// blocks fetched ahead once a reader looks sequential
+#define READAHEAD_MAX_WINDOW 64	// the window doubles on every refill up to this
+
+#define BLOCKMAP_SLOTS  32		// inodes whose block map is kept decoded in memory
+#define BLOCKMAP_BUDGET (128 * 1024)	// bytes all decoded maps together may use
+
+#define COMPRESS_CLUSTER 4	// file blocks compressed together on a compressed filesystem
+#define CLUSTER_SIZE     (COMPRESS_CLUSTER * BLOCK_SIZE)
+#define CLUSTER_BATCH    16	// clusters read or written with one round of disk requests
+#define CLUSTER_HEADER   ((int)sizeof(int))	// a compressed cluster starts with its compressed length
+
+#define REFS_MAX UINT16_MAX	// references past the first that a block's count can hold
+
+#define POINTER_FIND    0	// pointer_block_for: only look the pointer block up,
+#define POINTER_PRIVATE 1	// copy shared ones on the way so it can be changed,
+#define POINTER_CREATE  2	// or that and create missing ones too
+
+#define WRITEBUF_SLOTS 8		// inodes that can have buffered writes at once
+#define WRITEBUF_SIZE  (64 * 1024)	// a buffer is written out once it would grow past this
+
+#define INODE_LOCKS 64	// reader/writer locks, shared by inodes equal modulo this
+
+#define SCAN_MAX_THREADS 16	// workers walking the inode blocks in fs_mount and fs_debug
+#define SCAN_MIN_BLOCKS  16	// inode blocks a worker gets at the very least
 
 struct fs_superblock {
 	int magic;
 	int nblocks;
 	int ninodeblocks;
 	int ninodes;
+	int nbitmapblocks;	// free-block bitmap after the inode blocks; 0 on older images
+	int clean;		// set on unmount, cleared while mounted
+	int ninodebitmapblocks;	// free-inode bitmap after the free-block bitmap; 0 on older images
+	int version;		// FS_VERSION; 0 on images from before there were versions, read as 1
+	int blocksize;		// bytes per block; 0 on images from before it could be chosen, read as 4096
+	int inodeuninit;	// first inode block fs_format left unwritten, 0 once there is none (and on older images)
+	int compress;		// file data is kept in compressed clusters; 0 on older images
+	int nrefblocks;		// reference counts after the free-inode bitmap; 0 on images before version 5
+	int nhashblocks;	// content hashes of the blocks after that, for deduplication; 0 unless formatted for it
 };
 
-struct fs_inode {
+// an inode as version 1 images store it
+struct fs_inode_v1 {
 	int isvalid;
 	int size;
 	int direct[POINTERS_PER_INODE];
 	int indirect;
 };
 
+// and as version 2 images do
+struct fs_inode_v2 {
+	int isvalid;
+	int unused;
+	int64_t size;
+	int direct[POINTERS_PER_INODE];
+	int indirect;
+	int dindirect;	// double indirect block
+	int tindirect;	// triple indirect block
+	int reserved[4];
+};
+
+#define INODE_INLINE 1	// fs_inode flags: the data is in the inode, and there are no blocks
+
+// and as version 4 images do, where a small file's data can take the place of the pointers
+struct fs_inode_v4 {
+	int isvalid;
+	int flags;
+	int64_t size;
+	union {
+		struct {
+			int direct[POINTERS_PER_INODE];
+			int indirect;
+			int dindirect;
+			int tindirect;
+		} blocks;
+		char data[INODE_INLINE_MAX];
+	} u;
+};
+
+// an inode as the code below works with it, whichever version it was read from.
+// an inline inode has all its pointers 0.
+struct fs_inode {
+	int isvalid;
+	int flags;
+	long long size;
+	int direct[POINTERS_PER_INODE];
+	int indirect;
+	int dindirect;
+	int tindirect;
+	char data[INODE_INLINE_MAX];	// with INODE_INLINE: size bytes of file data, then zeros
+};
+
 union fs_block {
 	struct fs_superblock super;
-	struct fs_inode inode[INODES_PER_BLOCK];
-	int pointers[POINTERS_PER_BLOCK];
-	char data[DISK_BLOCK_SIZE];
+	struct fs_inode_v1 inode[INODES_PER_BLOCK];
+	struct fs_inode_v2 inode2[MAX_BLOCK_SIZE / sizeof(struct fs_inode_v2)];
+	struct fs_inode_v4 inode4[MAX_BLOCK_SIZE / sizeof(struct fs_inode_v4)];
+	int pointers[MAX_POINTERS_PER_BLOCK];
+	char data[MAX_BLOCK_SIZE];	// only the first BLOCK_SIZE bytes are the block
 };
 
-int fs_format()
-{
+// a union fs_block is sized for the largest block, far too big for a thread's stack,
+// so block buffers come from a per-thread pool, each only as large as the disk's blocks
+struct fs_blockpool {
+	int used;
+	int count;
+	union fs_block **blocks;
+	int *sizes;
+};
 
-	// create a new file system
-	union fs_block superblock;
+static __thread struct fs_blockpool blockpool;
+static pthread_key_t blockpoolkey;
+static pthread_once_t blockpoolonce = PTHREAD_ONCE_INIT;
 
-	// return failure on attempt to format an already-mounted disk
-	if (bitmap != NULL) {
-		printf("simplefs: Error! Cannot format an already-mounted disk.\n");
-		return 0;
+static void blockpool_free(void *arg)
+{
+	struct fs_blockpool *pool = arg;
+	for (int i = 0; i < pool->count; i++) {
+		free(pool->blocks[i]);
 	}
+	free(pool->blocks);
+	free(pool->sizes);
+	memset(pool, 0, sizeof(*pool));
+}
 
-	/* Write the superblock */
-	superblock.super.magic = FS_MAGIC;
-	superblock.super.nblocks = disk_size();
+static void blockpool_init()
+{
+	pthread_key_create(&blockpoolkey, blockpool_free);
+}
 
-	// set aside ten percent of the blocks for inodes
-	if (superblock.super.nblocks % 10 == 0) {
-		superblock.super.ninodeblocks = superblock.super.nblocks/10;
-	}
-	// round up
-	else {
-		superblock.super.ninodeblocks = superblock.super.nblocks/10 + 1;
-	}
-	
-	superblock.super.ninodes = INODES_PER_BLOCK * superblock.super.ninodeblocks;
+static union fs_block *block_get()
+{
+	struct fs_blockpool *pool = &blockpool;
+	int size = disk_block_size();
 
-	// write the superblock to disk
-	disk_write(0, superblock.data);
+	if (pool->used == pool->count) {
+		union fs_block **blocks = realloc(pool->blocks, (pool->count + 1) * sizeof(*blocks));
+		int *sizes = realloc(pool->sizes, (pool->count + 1) * sizeof(*sizes));
+		if (blocks) {
+			pool->blocks = blocks;
+		}
+		if (sizes) {
+			pool->sizes = sizes;
+		}
+		if (!blocks || !sizes) {
+			printf("simplefs: Error! Out of memory.\n");
+			abort();
+		}
+		// the thread's pool is handed back when it exits
+		if (pool->count == 0) {
+			pthread_once(&blockpoolonce, blockpool_init);
+			pthread_setspecific(blockpoolkey, pool);
+		}
+		pool->blocks[pool->count] = NULL;
+		pool->sizes[pool->count] = 0;
+		pool->count++;
+	}
 
-	// destroy any data already present (skipping the superblock)
-	union fs_block reset;
-	memset(reset.data, 0, BLOCK_SIZE);
-	
-	int i;
-	for (i = 1; i < superblock.super.ninodeblocks; i++) {
-		disk_write(i, reset.data);
+	// the disk's block size can change between mounts
+	int i = pool->used;
+	if (pool->sizes[i] < size) {
+		free(pool->blocks[i]);
+		pool->blocks[i] = malloc(size);
+		pool->sizes[i] = size;
+		if (!pool->blocks[i]) {
+			printf("simplefs: Error! Out of memory.\n");
+			abort();
+		}
 	}
-	
-	return 1;
+	pool->used++;
+	return pool->blocks[i];
 }
 
-void fs_debug()
+static void block_put(union fs_block **block)
 {
-	/* Scan a mounted filesystem */
-	union fs_block block;
+	(void)block;
+	blockpool.used--;
+}
 
-	disk_read(0, block.data);
+// a block buffer for the rest of the enclosing scope
+#define BLOCK_BUFFER(name) union fs_block *name __attribute__((cleanup(block_put))) = block_get()
 
-	printf("superblock:\n");
+// look at a block without modifying it: in place when the disk is memory mapped,
+// otherwise copied into scratch
+static const union fs_block *block_view(int blocknum, union fs_block *scratch)
+{
+	const char *mapped = disk_map(blocknum);
+	if (mapped) {
+		return (const union fs_block *)mapped;
+	}
 
-	if (block.super.magic == FS_MAGIC) {
-		printf("magic number is valid\n");
+	disk_read(blocknum, scratch->data);
+	return scratch;
+}
+
+// copy inode index out of an inode block of the given format version
+static void inode_load(const union fs_block *block, int version, int index, struct fs_inode *inode)
+{
+	memset(inode, 0, sizeof(*inode));
+	if (version >= 4) {
+		const struct fs_inode_v4 *disk = &block->inode4[index];
+		inode->isvalid = disk->isvalid;
+		inode->flags = disk->flags;
+		inode->size = disk->size;
+		if (inode->flags & INODE_INLINE) {
+			memcpy(inode->data, disk->u.data, sizeof(inode->data));
+		}
+		else {
+			memcpy(inode->direct, disk->u.blocks.direct, sizeof(inode->direct));
+			inode->indirect = disk->u.blocks.indirect;
+			inode->dindirect = disk->u.blocks.dindirect;
+			inode->tindirect = disk->u.blocks.tindirect;
+		}
+	}
+	else if (version >= 2) {
+		const struct fs_inode_v2 *disk = &block->inode2[index];
+		inode->isvalid = disk->isvalid;
+		inode->size = disk->size;
+		memcpy(inode->direct, disk->direct, sizeof(inode->direct));
+		inode->indirect = disk->indirect;
+		inode->dindirect = disk->dindirect;
+		inode->tindirect = disk->tindirect;
 	}
 	else {
-		printf("simplefs: Error! Magic number is invalid.\n");
-		return;
+		const struct fs_inode_v1 *disk = &block->inode[index];
+		inode->isvalid = disk->isvalid;
+		inode->size = disk->size;
+		memcpy(inode->direct, disk->direct, sizeof(inode->direct));
+		inode->indirect = disk->indirect;
 	}
+}
 
-	printf("\t%d blocks on disk\n", block.super.nblocks);
-	printf("\t%d blocks for inodes\n", block.super.ninodeblocks);
-	printf("\t%d inodes total\n", block.super.ninodes);
+// and back in; a version 1 inode never grows past what it can hold, and only version 4
+// inodes are ever inline
+static void inode_store(union fs_block *block, int version, int index, const struct fs_inode *inode)
+{
+	if (version >= 4) {
+		struct fs_inode_v4 *disk = &block->inode4[index];
+		memset(disk, 0, sizeof(*disk));
+		disk->isvalid = inode->isvalid;
+		disk->flags = inode->flags;
+		disk->size = inode->size;
+		if (inode->flags & INODE_INLINE) {
+			memcpy(disk->u.data, inode->data, sizeof(disk->u.data));
+		}
+		else {
+			memcpy(disk->u.blocks.direct, inode->direct, sizeof(disk->u.blocks.direct));
+			disk->u.blocks.indirect = inode->indirect;
+			disk->u.blocks.dindirect = inode->dindirect;
+			disk->u.blocks.tindirect = inode->tindirect;
+		}
+	}
+	else if (version >= 2) {
+		struct fs_inode_v2 *disk = &block->inode2[index];
+		memset(disk, 0, sizeof(*disk));
+		disk->isvalid = inode->isvalid;
+		disk->size = inode->size;
+		memcpy(disk->direct, inode->direct, sizeof(disk->direct));
+		disk->indirect = inode->indirect;
+		disk->dindirect = inode->dindirect;
+		disk->tindirect = inode->tindirect;
+	}
+	else {
+		struct fs_inode_v1 *disk = &block->inode[index];
+		disk->isvalid = inode->isvalid;
+		disk->size = inode->size;
+		memcpy(disk->direct, inode->direct, sizeof(disk->direct));
+		disk->indirect = inode->indirect;
+	}
+}
 
-	/* Report on how the inodes are organized */
+// one bit per block, packed into 64-bit words (a set bit means in use)
+struct fs_bitmap {
+	uint64_t *words;
+	int nwords;
+	int nbits;
+	int nfree;	// running count of clear bits
+	int hint;	// where the next search starts (next-fit)
+	int diskstart;	// first block of the on-disk copy, if there is one
+	int ndiskblocks;
+	char *dirty;	// which on-disk blocks are stale, NULL if not persisted
+};
 
-	union fs_block inodeblock;
-	struct fs_inode inode;
+// a persisted array with one fixed-size entry per block on disk. like the bitmaps it is kept
+// in memory while mounted and written back a block at a time as it changes
+struct fs_table {
+	char *entries;	// NULL if the filesystem has no such table
+	int entrysize;
+	int n;
+	int diskstart;
+	int ndiskblocks;
+	char *dirty;
+};
 
-	// starting at the second block
-	// loop through every inode block
-	int i;
-	for (i = 1; i < block.super.ninodeblocks; i++) {
-		disk_read(i, inodeblock.data);
+// blocks by the hash of their contents, for finding a copy of a block already on disk.
+// open addressing with linear probing; a slot with blocknum 0 is empty
+struct fs_dedupslot {
+	uint64_t hash;
+	int blocknum;
+};
 
-		// loop through every inode in the block
-		int j;
-		for (j = 0; j < INODES_PER_BLOCK; j++) {
-			inode = inodeblock.inode[j];
+struct fs_dedupindex {
+	struct fs_dedupslot *slots;
+	int capacity;	// a power of two, or 0 before the first insert
+	int count;
+};
 
-			// check if inode is valid
-			if (inode.isvalid) {
-				printf("inode %d:\n", j);
-				printf("\tsize: %d bytes\n", inode.size);
-		
-				// go through all 5 direct pointers to data blocks
-				printf("\tdirect blocks:");
-				int k;
-				for (k = 0; (k * BLOCK_SIZE < inode.size) && (k < 5); k++) {
-					printf(" %d", inode.direct[k]);
-				}
-				printf("\n");
+// per-inode sequential read tracking, plus the blocks already fetched ahead of the reader
+struct fs_readahead {
+	int inumber;	// 0 when the slot is unused
+	long long nextoffset;	// where a sequential reader picks up next
+	int window;	// blocks to fetch on the next refill
+	int first;	// file block held at the start of data
+	int count;	// how many blocks data holds
+	int lastuse;
+	char *data;	// READAHEAD_MAX_WINDOW blocks
+	pthread_mutex_t busy;	// held by the fs_read using the slot
+};
 
-				// check for indirect block (inode size will be greater than the total size of 5 direct blocks)
-				if (inode.size > 5 * BLOCK_SIZE) {
-					printf("\tindirect block: %d\n", inode.indirect);
+// the decoded file-block -> disk-block map of one inode (direct pointers, then the indirect ones)
+struct fs_blockmap {
+	int inumber;	// 0 when the slot is unused
+	int nblocks;	// entries in map; file blocks past the end are unallocated
+	int lastuse;
+	int *map;
+};
 
-					// find the indirect data blocks
-					union fs_block blockforindirects;
-					disk_read(inode.indirect, blockforindirects.data);
+// writes to one inode that have not reached the disk yet: length bytes of file data at offset.
+// no blocks are allocated for them until the buffer is flushed.
+struct fs_writebuffer {
+	int inumber;	// 0 when the slot is unused
+	long long offset;
+	int length;
+	int lastuse;
+	int reserved;	// blocks of fs.reserved held for writing it out
+	char *data;	// WRITEBUF_SIZE bytes
+};
 
-					int indirectblocks;
-					if (inode.size % BLOCK_SIZE == 0) {
-						indirectblocks = inode.size/BLOCK_SIZE - 5; 
-					}
-					else {
-						indirectblocks = inode.size/BLOCK_SIZE - 5 + 1;
-					}
+// everything we know about the mounted filesystem, filled in once by fs_mount.
+//
+// several threads may call fs_read, fs_write, fs_fallocate, fs_create, fs_delete, fs_getsize,
+// fs_sync and fs_debug at once. an inode's contents are guarded by its entry in inodelocks
+// (shared for reading, exclusive for changing it); lock protects everything else here, the
+// inode blocks on disk, and the helpers below that touch them, which expect it held.
+// an inode lock is always taken before lock, never the other way round.
+struct fs_mountstate {
+	int mounted;
+	int blocksize;	// bytes per block of the disk in use, set by fs_format, fs_mount and fs_debug
+	int superdirty;	// super differs from block 0 on disk
+	struct fs_superblock super;
+	struct fs_bitmap bitmap;
+	struct fs_bitmap inodemap;	// one bit per inode, inode 0 is never handed out
+	struct fs_readahead readahead[READAHEAD_SLOTS];
+	int readaheadclock;
+	struct fs_blockmap blockmaps[BLOCKMAP_SLOTS];
+	int blockmapbytes;	// memory held by all maps, kept under BLOCKMAP_BUDGET
+	int blockmapclock;
+	struct fs_writebuffer writebufs[WRITEBUF_SLOTS];
+	int writebufclock;
+	int reserved;	// free blocks promised to buffered writes, which nothing else may take
+	long long nclusters;	// clusters written compressed since mount
+	long long nclusterblocks;	// and the blocks they took
+	long long nrawclusters;	// clusters that did not compress and were written as they were
+	struct fs_table refs;	// uint16_t per block: its references past the first (0 with one owner, or none)
+	struct fs_table hashes;	// uint64_t per block: the hash of its contents, 0 if not known
+	struct fs_dedupindex dedup;	// the blocks with a known hash, looked up by it
+	long long nshared;	// sum of refs: the blocks saved by sharing
+	pthread_mutex_t lock;
+	pthread_rwlock_t inodelocks[INODE_LOCKS];
+};
 
-					printf("\tindirect data blocks:");
+static struct fs_mountstate fs = { .lock = PTHREAD_MUTEX_INITIALIZER, .blocksize = DISK_BLOCK_SIZE };
 
-					int l;
-					for (l = 0; l < indirectblocks; l++) {
-						printf(" %d", blockforindirects.pointers[l]);
-					}
-					printf("\n");
-				}
-			}
-		}
-	}	
+static int inodes_per_block(int version)
+{
+	return version >= 4 ? INODES_PER_BLOCK_V4 : version >= 2 ? INODES_PER_BLOCK_V2 : INODES_PER_BLOCK;
 }
 
-int fs_mount() 
+static int superblock_block_size(const struct fs_superblock *super)
 {
+	return super->blocksize > 0 ? super->blocksize : DISK_BLOCK_SIZE;
+}
 
-	// read the superblock
-	union fs_block block;
-	disk_read(0, block.data); 
-
-	// create array of integers in memory for our bitmap
-	bitmap = calloc(block.super.nblocks, sizeof(int)); 
-	// set bitmap size
-	sizeBitmap = block.super.nblocks; 
-
-	union fs_block inode_block;
-	struct fs_inode inode;
-	int i;
+static pthread_rwlock_t *inode_lock(int inumber)
+{
+	return &fs.inodelocks[inumber % INODE_LOCKS];
+}
 
-	// loop through the inode blocks
-	for (i = 1; i < block.super.ninodeblocks; i++) { 
-		disk_read(i, inode_block.data);
-		int j;
-		for (j = 0; j < INODES_PER_BLOCK; j++) { //loops through inodes in each inode block.
-			inode = inode_block.inode[j];
-			if (inode.isvalid) {
-				bitmap[i] = 1;
-				int k;
-				for (k = 0; k * BLOCK_SIZE < inode.size && k < 5; k++) { //loops through all direct pointers in inode.
-					bitmap[inode.direct[k]] = 1;
-				}
-				if (inode.size > 5 * BLOCK_SIZE) {
-					bitmap[inode.indirect] = 1;
-
-					union fs_block temp;
-					disk_read(inode.indirect, temp.data);
-					int q;
-					int indirectblocks; //determines number of indirect blocks.
-					if (inode.size % BLOCK_SIZE == 0) {
-						indirectblocks = inode.size / BLOCK_SIZE - 5;
-					}
-					else {
-						indirectblocks = inode.size / BLOCK_SIZE - 5 + 1;
-					}
-					for (q = 0; q < indirectblocks; q++) { //loops through indirect block
-						bitmap[temp.pointers[q]] = 1;
-					}
-				}
-			}
+static void writebuf_flush_inode(int inumber);
+static void writebuf_flush_all();
+static void writebuf_release();
+static int writebuf_pending(int inumber);
+static void writebuf_forget(int inumber);
+static long long writebuf_size(int inumber, long long size);
+static int data_block_ok(int blocknum);
 
-		}
+static int bitmap_init(struct fs_bitmap *map, int nbits)
+{
+	map->nbits = nbits;
+	map->nwords = (nbits + 63) / 64;
+	map->words = calloc(map->nwords, sizeof(uint64_t));
+	if (map->words == NULL) {
+		return 0;
 	}
 
+	// the unused tail of the last word is marked in use so searches never return it
+	if (nbits % 64) {
+		map->words[map->nwords - 1] = ~0ULL << (nbits % 64);
+	}
 
+	map->nfree = nbits;
+	map->hint = 0;
 	return 1;
 }
 
-int getInodeNumber(int blockindex, int inodeindex) {
-	int temp = ((blockindex - 1) * INODES_PER_BLOCK) + inodeindex;
-	return temp;
+static void bitmap_free(struct fs_bitmap *map)
+{
+	free(map->words);
+	free(map->dirty);
+	memset(map, 0, sizeof(*map));
 }
 
-int fs_create()
+// back the bitmap with ndiskblocks blocks starting at diskstart
+static int bitmap_attach(struct fs_bitmap *map, int diskstart, int ndiskblocks)
 {
-	// no mounted disk
-	if (bitmap == NULL) {
-		printf("simplefs: Error! No mounted disk.\n");
+	map->dirty = calloc(ndiskblocks, 1);
+	if (map->dirty == NULL) {
 		return 0;
 	}
 
-	union fs_block block;
-	disk_read(0, block.data);
-
-	int i;
-	// loop through all inode blocks
-	for (i = 1; i < block.super.ninodeblocks + 1; i++) {
-		// read in every inode block
-		disk_read(i, block.data);
-
-		struct fs_inode inode;
-		int j;
-		// loop through all inodes in our inode block
-		for (j = 0; j < INODES_PER_BLOCK; j++) {
-			if (j == 0 && i == 1) {
-				j = 1; //deals with invalid inode 0
-			}
+	map->diskstart = diskstart;
+	map->ndiskblocks = ndiskblocks;
+	return 1;
+}
 
-			// read in inode at that index
-			inode = block.inode[j];
+static void bitmap_mark_dirty(struct fs_bitmap *map, int bit)
+{
+	if (map->dirty) {
+		map->dirty[bit / BITS_PER_BLOCK] = 1;
+	}
+}
 
-			// check if inode is valid
-			if (!inode.isvalid) {
-				// inode is invalid; we will store our new inode here
-				// set our new inode (reset direct and indirect pointers and set size to 0)
-				inode.size = 0;
-				memset(inode.direct, 0, sizeof(inode.direct));
-				inode.indirect = 0;
-				inode.isvalid = 1;
-				
-				// update bitmap
-				bitmap[i] = 1;
-				// set the inode at the index in the block to our new inode
-				block.inode[j] = inode;
-				// write updated inode block to disk
-				disk_write(i, block.data);
+// count the clear bits again after the words were filled in wholesale
+static void bitmap_recount(struct fs_bitmap *map)
+{
+	int w;
 
-				// on success, return the inode number
-				int inodeNumber = getInodeNumber(i, j);
-				return inodeNumber;
-			}
-		}
+	map->nfree = 0;
+	for (w = 0; w < map->nwords; w++) {
+		map->nfree += 64 - __builtin_popcountll(map->words[w]);
 	}
-
-	// return 0 on failure to create inode (all inode blocks are full)
-	printf("simplefs: Error! Unable to create new inode.\n");
-	return 0;
+	map->hint = 0;
 }
 
-int getBlockNumber(int inumber) {
-	int temp = (inumber + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK; 
-	return temp;
+// fold a partial bitmap of the same size into map; the caller recounts afterwards
+static void bitmap_merge(struct fs_bitmap *map, const struct fs_bitmap *part)
+{
+	int w;
+
+	for (w = 0; w < map->nwords; w++) {
+		map->words[w] |= part->words[w];
+	}
 }
 
-int fs_delete(int inumber)
+// read the on-disk copy and recount the free bits
+static void bitmap_load(struct fs_bitmap *map)
 {
-	// find the block index that we need
-	int blockNumber = getBlockNumber(inumber);
+	BLOCK_BUFFER(block);
+	int i;
 
-	union fs_block block;
-	disk_read(0, block.data);
+	for (i = 0; i < map->ndiskblocks; i++) {
+		const union fs_block *view = block_view(map->diskstart + i, block);
 
-	// ensure that the index is not beyond the bounds
-	if (blockNumber > block.super.ninodeblocks)
-	{
-		printf("simplefs: Error! Block number is out of bounds.\n");
-		return 0;
+		int nwords = map->nwords - i * WORDS_PER_BLOCK;
+		if (nwords > WORDS_PER_BLOCK) {
+			nwords = WORDS_PER_BLOCK;
+		}
+		memcpy(&map->words[i * WORDS_PER_BLOCK], view->data, nwords * sizeof(uint64_t));
 	}
-	//read in the data from our inode block
-	disk_read(blockNumber, block.data);
 
-	struct fs_inode inode = block.inode[inumber % 128];
-	if (inode.isvalid) {
-		//zero out everything in the inode struct.
-		inode.size = 0;
-		memset(inode.direct, 0, sizeof(inode.direct));
-		inode.indirect = 0;
-		inode.isvalid = 0;
-		block.inode[inumber % 128] = inode; //update block's inode.
-		disk_write(blockNumber, block.data);
-		return 1;
+	if (map->nbits % 64) {
+		map->words[map->nwords - 1] |= ~0ULL << (map->nbits % 64);
 	}
 
-	// return 0 if it's an invalid inode
-	printf("simplefs: Error! Unable to delete inode.\n");
-	return 0;
+	bitmap_recount(map);
 }
 
-int fs_getsize(int inumber)
+// write back every on-disk bitmap block that has changed
+static void bitmap_sync(struct fs_bitmap *map)
 {
-	// get inode block
-	int blockNumber = getBlockNumber(inumber);
-
-	// read in the super block
-	union fs_block block;
-	disk_read(0, block.data);
+	BLOCK_BUFFER(block);
+	int i;
 
-	// check if the block number is valid; return -1 on error
-	if (blockNumber > block.super.ninodeblocks)
-	{
-		printf("simplefs: Error! Block number is out of bounds.\n");
-		return -1;
+	if (map->dirty == NULL) {
+		return;
 	}
 
-	// read in the inode block
-	disk_read(blockNumber, block.data);
+	for (i = 0; i < map->ndiskblocks; i++) {
+		if (!map->dirty[i]) {
+			continue;
+		}
 
-	// read in the inode
-	struct fs_inode inode = block.inode[inumber % 128];
+		int nwords = map->nwords - i * WORDS_PER_BLOCK;
+		if (nwords > WORDS_PER_BLOCK) {
+			nwords = WORDS_PER_BLOCK;
+		}
+		memset(block->data, 0, BLOCK_SIZE);
+		memcpy(block->data, &map->words[i * WORDS_PER_BLOCK], nwords * sizeof(uint64_t));
+		disk_write(map->diskstart + i, block->data);
+		map->dirty[i] = 0;
+	}
+}
 
-	// check if inode is valid; return size on success
-	if (inode.isvalid)
-	{
-		return inode.size;
+static int table_init(struct fs_table *t, int n, int entrysize, int diskstart, int ndiskblocks)
+{
+	t->entries = calloc(n, entrysize);
+	t->dirty = calloc(ndiskblocks, 1);
+	if (t->entries == NULL || t->dirty == NULL) {
+		free(t->entries);
+		free(t->dirty);
+		memset(t, 0, sizeof(*t));
+		return 0;
 	}
 
-	// inode is invalid; return -1 on error
-	printf("simplefs: Error! Invalid inode number.\n");
-	return -1;
+	t->n = n;
+	t->entrysize = entrysize;
+	t->diskstart = diskstart;
+	t->ndiskblocks = ndiskblocks;
+	return 1;
 }
 
-int fs_read( int inumber, char *data, int length, int offset )
+static void table_free(struct fs_table *t)
 {
-	// get inode block
-	int blockNumber = getBlockNumber(inumber);
+	free(t->entries);
+	free(t->dirty);
+	memset(t, 0, sizeof(*t));
+}
+
+static void table_mark_dirty(struct fs_table *t, int i)
+{
+	t->dirty[(long long)i * t->entrysize / BLOCK_SIZE] = 1;
+}
 
-	// read in the super block
-	union fs_block block;
-	disk_read(0, block.data);
+static void table_load(struct fs_table *t)
+{
+	BLOCK_BUFFER(block);
+	long long bytes = (long long)t->n * t->entrysize;
+	int i;
 
-	// check if the block number is valid; return -1 on error
-	if (blockNumber > block.super.ninodeblocks || blockNumber == 0)
-	{
-		printf("simplefs: Error! Block number is out of bounds.\n");
-		return -1;
-	}
+	for (i = 0; i < t->ndiskblocks; i++) {
+		const union fs_block *view = block_view(t->diskstart + i, block);
+		long long start = (long long)i * BLOCK_SIZE;
 
-	// read in the data from the inode block
-	disk_read(blockNumber, block.data);
+		memcpy(&t->entries[start], view->data, bytes - start < BLOCK_SIZE ? bytes - start : BLOCK_SIZE);
+	}
+}
 
-	// read in the inode we want
-	struct fs_inode inode;
-	inode = block.inode[inumber % 128];
+// write back every on-disk block of the table that has changed
+static void table_sync(struct fs_table *t)
+{
+	BLOCK_BUFFER(block);
+	long long bytes = (long long)t->n * t->entrysize;
+	int i;
 
-	// return error if inode is invalid
-	if (!inode.isvalid)
-	{
-		printf("simplefs: Error! Invalid inode.\n");
-		return 0;
+	if (t->entries == NULL) {
+		return;
 	}
-	// return error if inode's size is 0
-	else if (inode.size == 0)
-	{
-		printf("simplefs: Error! Inode's size is 0.\n");
-		return 0;
+
+	for (i = 0; i < t->ndiskblocks; i++) {
+		if (!t->dirty[i]) {
+			continue;
+		}
+
+		long long start = (long long)i * BLOCK_SIZE;
+		memset(block->data, 0, BLOCK_SIZE);
+		memcpy(block->data, &t->entries[start], bytes - start < BLOCK_SIZE ? bytes - start : BLOCK_SIZE);
+		disk_write(t->diskstart + i, block->data);
+		t->dirty[i] = 0;
 	}
-	// return error if offset is out of bounds
-	else if (inode.size < offset)
-	{
-		printf("simplefs: Error! Offset is out of bounds.\n");
-		return 0;
+}
+
+static int bitmap_test(const struct fs_bitmap *map, int bit)
+{
+	return (map->words[bit / 64] >> (bit % 64)) & 1;
+}
+
+// mark a bit in use; out-of-range bits (e.g. from a corrupt pointer) are ignored
+static void bitmap_set(struct fs_bitmap *map, int bit)
+{
+	if (bit < 0 || bit >= map->nbits || bitmap_test(map, bit)) {
+		return;
 	}
 
-	// find the direct block we want to read from
-	int directindex = offset / BLOCK_SIZE;
-	if (directindex > 5)
-	{
-		printf("simplefs: Error! Direct block index is out of bounds.\n");
-		return 0;
+	map->words[bit / 64] |= 1ULL << (bit % 64);
+	map->nfree--;
+	bitmap_mark_dirty(map, bit);
+}
+
+static void bitmap_clear(struct fs_bitmap *map, int bit)
+{
+	if (bit < 0 || bit >= map->nbits || !bitmap_test(map, bit)) {
+		return;
 	}
 
-	// adjust length if the end of the inode is reached before that amount of bytes are read
-	if (inode.size < length + offset)
-	{
-		length = inode.size - offset;
+	map->words[bit / 64] &= ~(1ULL << (bit % 64));
+	map->nfree++;
+	bitmap_mark_dirty(map, bit);
+}
+
+// return the first clear bit in [lo, hi), or -1; full words are skipped whole
+static int bitmap_find_clear(const struct fs_bitmap *map, int lo, int hi)
+{
+	if (lo >= hi) {
+		return -1;
 	}
 
-	// iterate through the direct blocks and read in the data
-	union fs_block directblock;
-	int totalbytesread = 0;
-	memset(data, 0, length);
-	int tempbytesread = BLOCK_SIZE;
-	while (directindex < 5 && totalbytesread < length)
-	{
-		disk_read(inode.direct[directindex], directblock.data);
+	int w = lo / 64;
+	uint64_t bits = ~map->words[w] & (~0ULL << (lo % 64));
 
-		// adjust tempbytesread variable if we have reached the end of the inode
-		if (tempbytesread + totalbytesread > length)
-		{
-			tempbytesread = length - totalbytesread;
+	while (1) {
+		if (bits) {
+			int bit = w * 64 + __builtin_ctzll(bits);
+			return bit < hi ? bit : -1;
 		}
 
-		// append read data to our data variable
-		strncat(data, directblock.data, tempbytesread);
-		directindex++;
-		totalbytesread += tempbytesread;
+		w++;
+		if (w * 64 >= hi) {
+			return -1;
+		}
+		bits = ~map->words[w];
 	}
+}
 
-	// read from indirect block if we still have bytes left to be read
-	if (totalbytesread < length)
-	{
+// return the first set bit in [lo, hi), or hi if they are all clear
+static int bitmap_find_set(const struct fs_bitmap *map, int lo, int hi)
+{
+	if (lo >= hi) {
+		return hi;
+	}
 
-		// read in the indirect block
-		union fs_block indirectblock;
-		union fs_block tempblock;
-		disk_read(inode.indirect, indirectblock.data);
+	int w = lo / 64;
+	uint64_t bits = map->words[w] & (~0ULL << (lo % 64));
 
-		// iterate through the indirect data blocks
-		int indirectblocks;
-		if (inode.size % BLOCK_SIZE == 0)
-		{
-			indirectblocks = inode.size / BLOCK_SIZE - 5;
+	while (1) {
+		if (bits) {
+			int bit = w * 64 + __builtin_ctzll(bits);
+			return bit < hi ? bit : hi;
 		}
-		else
-		{
-			indirectblocks = inode.size / BLOCK_SIZE - 5 + 1;
+
+		w++;
+		if (w * 64 >= hi) {
+			return hi;
 		}
+		bits = map->words[w];
+	}
+}
+
+// look for want clear bits in a row within [lo, hi), keeping track of the longest run seen.
+// returns 1 once a run of the full length is found.
+static int bitmap_find_run(const struct fs_bitmap *map, int lo, int hi, int want, int *best, int *bestlen)
+{
+	int bit = bitmap_find_clear(map, lo, hi);
+
+	while (bit >= 0) {
+		int limit = hi - bit > want ? bit + want : hi;
+		int end = bitmap_find_set(map, bit, limit);
+		if (end - bit > *bestlen) {
+			*best = bit;
+			*bestlen = end - bit;
+			if (*bestlen == want) {
+				return 1;
+			}
+		}
+		bit = bitmap_find_clear(map, end, hi);
+	}
+	return 0;
+}
+
+// claim up to want neighbouring clear bits at or above first, searching from the hint and
+// wrapping around. the first run long enough wins, otherwise the longest one there is.
+// returns how many bits were claimed, starting at *start.
+static int bitmap_alloc_run(struct fs_bitmap *map, int first, int want, int *start)
+{
+	if (map->nfree == 0 || want <= 0) {
+		return 0;
+	}
+
+	int from = map->hint < first ? first : map->hint;
+	int best = -1, bestlen = 0;
+	if (!bitmap_find_run(map, from, map->nbits, want, &best, &bestlen)) {
+		bitmap_find_run(map, first, from, want, &best, &bestlen);
+	}
+	if (bestlen == 0) {
+		return 0;
+	}
+
+	int i;
+	for (i = 0; i < bestlen; i++) {
+		bitmap_set(map, best + i);
+	}
+	map->hint = best + bestlen;
+	*start = best;
+	return bestlen;
+}
+
+// claim a clear bit at or above first, searching from the hint and wrapping around
+static int bitmap_alloc(struct fs_bitmap *map, int first)
+{
+	if (map->nfree == 0) {
+		return -1;
+	}
+
+	int start = map->hint < first ? first : map->hint;
+	int bit = bitmap_find_clear(map, start, map->nbits);
+	if (bit < 0) {
+		bit = bitmap_find_clear(map, first, start);
+	}
+	if (bit < 0) {
+		return -1;
+	}
+
+	bitmap_set(map, bit);
+	map->hint = bit + 1;
+	return bit;
+}
+
+// find the readahead state for an inode, recycling the least recently used slot if it has none.
+// the slot comes back with busy held; NULL if another reader of the inode is using it, or
+// every slot is in use.
+static struct fs_readahead *readahead_lookup(int inumber)
+{
+	struct fs_readahead *victim = NULL;
+	int i;
+
+	fs.readaheadclock++;
+	for (i = 0; i < READAHEAD_SLOTS; i++) {
+		struct fs_readahead *ra = &fs.readahead[i];
+		if (ra->inumber == inumber) {
+			if (victim) {
+				pthread_mutex_unlock(&victim->busy);
+			}
+			if (pthread_mutex_trylock(&ra->busy) != 0) {
+				return NULL;
+			}
+			ra->lastuse = fs.readaheadclock;
+			return ra;
+		}
+		if (victim == NULL || ra->lastuse < victim->lastuse) {
+			if (pthread_mutex_trylock(&ra->busy) == 0) {
+				if (victim) {
+					pthread_mutex_unlock(&victim->busy);
+				}
+				victim = ra;
+			}
+		}
+	}
+	if (victim == NULL) {
+		return NULL;
+	}
+
+	if (victim->data == NULL) {
+		victim->data = malloc((size_t)READAHEAD_MAX_WINDOW * BLOCK_SIZE);
+		if (victim->data == NULL) {
+			pthread_mutex_unlock(&victim->busy);
+			return NULL;
+		}
+	}
+
+	victim->inumber = inumber;
+	victim->nextoffset = 0;	// a reader starting at the front counts as sequential
+	victim->window = 0;
+	victim->count = 0;
+	victim->lastuse = fs.readaheadclock;
+	return victim;
+}
+
+// drop whatever we know about an inode (it was written or deleted)
+static void readahead_forget(int inumber)
+{
+	int i;
+
+	for (i = 0; i < READAHEAD_SLOTS; i++) {
+		if (fs.readahead[i].inumber == inumber) {
+			fs.readahead[i].inumber = 0;
+			fs.readahead[i].count = 0;
+			fs.readahead[i].lastuse = 0;
+		}
+	}
+}
+
+static void readahead_release()
+{
+	int i;
+
+	for (i = 0; i < READAHEAD_SLOTS; i++) {
+		struct fs_readahead *ra = &fs.readahead[i];
+		free(ra->data);
+		ra->data = NULL;
+		ra->inumber = 0;
+		ra->count = 0;
+		ra->lastuse = 0;
+	}
+	fs.readaheadclock = 0;
+}
+
+// number of blocks needed to hold size bytes
+static int size_to_blocks(long long size)
+{
+	return (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+// the most blocks a file can have in the given format version. with big blocks the triple
+// indirect tree reaches further than an int counts, and files stop there.
+static int file_blocks_limit(int version)
+{
+	long long n = POINTERS_PER_INODE + (long long)POINTERS_PER_BLOCK;
+
+	if (version >= 2) {
+		n += (long long)POINTERS_PER_BLOCK * POINTERS_PER_BLOCK;
+		n += (long long)POINTERS_PER_BLOCK * POINTERS_PER_BLOCK * POINTERS_PER_BLOCK;
+	}
+	return n > INT_MAX ? INT_MAX : n;
+}
+
+// the most blocks a file can have on the mounted filesystem
+static int max_file_blocks()
+{
+	return file_blocks_limit(fs.super.version);
+}
+
+// the largest size the inode can have as it is stored now
+static long long inode_size_limit(const struct fs_inode *inode)
+{
+	return inode->flags & INODE_INLINE ? INODE_INLINE_MAX : (long long)max_file_blocks() * BLOCK_SIZE;
+}
+
+// how many file blocks one pointer in a pointer block of this level stands for
+// (the indirect block is level 1, the double and triple indirect blocks 2 and 3)
+static long long level_span(int level)
+{
+	long long span = 1;
+
+	while (--level > 0) {
+		span *= POINTERS_PER_BLOCK;
+	}
+	return span;
+}
+
+static inline __attribute__((always_inline)) int pointers_used_n(const int *pointers, int n)
+{
+	while (n > 0 && pointers[n - 1] == 0) {
+		n--;
+	}
+	return n;
+}
+
+// the pointers in a pointer block up to the last one set. the usual block sizes get a loop
+// of constant length, which the compiler unrolls and vectorizes.
+static int pointers_used(const int *pointers)
+{
+	switch (BLOCK_SIZE) {
+	case 4096:
+		return pointers_used_n(pointers, 4096 / sizeof(int));
+	case 8192:
+		return pointers_used_n(pointers, 8192 / sizeof(int));
+	case 16384:
+		return pointers_used_n(pointers, 16384 / sizeof(int));
+	case 32768:
+		return pointers_used_n(pointers, 32768 / sizeof(int));
+	case 65536:
+		return pointers_used_n(pointers, 65536 / sizeof(int));
+	default:
+		return pointers_used_n(pointers, POINTERS_PER_BLOCK);
+	}
+}
+
+// the level of the pointer block tree file block n (past the direct blocks) hangs off,
+// and its number counted from the first block of that tree
+static int file_block_level(int n, int *rel)
+{
+	n -= POINTERS_PER_INODE;
+	if (n < POINTERS_PER_BLOCK) {
+		*rel = n;
+		return 1;
+	}
+	n -= POINTERS_PER_BLOCK;
+	if (n < POINTERS_PER_BLOCK * POINTERS_PER_BLOCK) {
+		*rel = n;
+		return 2;
+	}
+	*rel = n - POINTERS_PER_BLOCK * POINTERS_PER_BLOCK;
+	return 3;
+}
+
+static int inode_root(const struct fs_inode *inode, int level)
+{
+	return level == 1 ? inode->indirect : level == 2 ? inode->dindirect : inode->tindirect;
+}
+
+// fill blocks[] with the disk block behind each of count file blocks starting at first (0 if unallocated,
+// a hole that reads as zeros). a pointer out of range, which only an unchecked disk can have, is
+// taken for a hole too
+static void inode_map_blocks(const struct fs_inode *inode, int first, int count, int *blocks)
+{
+	// the pointer block last read at each level, so neighbours cost no extra reads
+	BLOCK_BUFFER(scratch0);
+	BLOCK_BUFFER(scratch1);
+	BLOCK_BUFFER(scratch2);
+	union fs_block *scratch[3] = { scratch0, scratch1, scratch2 };
+	const union fs_block *view[3] = { NULL, NULL, NULL };
+	int viewnum[3] = { 0, 0, 0 };
+	int i;
+
+	for (i = 0; i < count; i++) {
+		int n = first + i;
+		if (n < POINTERS_PER_INODE) {
+			blocks[i] = data_block_ok(inode->direct[n]) ? inode->direct[n] : 0;
+			continue;
+		}
+
+		int rel;
+		int level = file_block_level(n, &rel);
+		int blocknum = inode_root(inode, level);
+		long long span = level_span(level + 1);
+		int l;
+		for (l = level; l >= 1 && data_block_ok(blocknum); l--) {
+			if (view[l - 1] == NULL || viewnum[l - 1] != blocknum) {
+				view[l - 1] = block_view(blocknum, scratch[l - 1]);
+				viewnum[l - 1] = blocknum;
+			}
+			blocknum = view[l - 1]->pointers[(rel / level_span(l)) % POINTERS_PER_BLOCK];
+			span = level_span(l);
+		}
+		if (!data_block_ok(blocknum)) {
+			blocknum = 0;
+		}
+		blocks[i] = blocknum;
+
+		// a missing pointer block makes a hole of everything it would have covered
+		if (blocknum == 0 && span > 1) {
+			long long holes = span - rel % span;
+			int fill = holes < count - i ? holes : count - i;
+			memset(&blocks[i], 0, fill * sizeof(int));
+			i += fill - 1;
+		}
+	}
+}
+
+// file blocks up to the end of the last pointer block the inode has in use: no block
+// past this is allocated
+static int inode_span(const struct fs_inode *inode)
+{
+	int level;
+
+	for (level = 3; level >= 1; level--) {
+		int root = inode_root(inode, level);
+		if (!data_block_ok(root)) {
+			continue;
+		}
+
+		BLOCK_BUFFER(scratch);
+		const union fs_block *block = block_view(root, scratch);
+		int k = pointers_used(block->pointers);
+		long long start = POINTERS_PER_INODE;
+		int l;
+		for (l = 1; l < level; l++) {
+			start += level_span(l + 1);
+		}
+		start += k * level_span(level);
+		return start > INT_MAX ? INT_MAX : start;
+	}
+	return POINTERS_PER_INODE;
+}
+
+// no data and no blocks: on a version 4 disk, the first write may keep the data in the inode
+static int inode_empty(const struct fs_inode *inode)
+{
+	int k;
+
+	for (k = 0; k < POINTERS_PER_INODE; k++) {
+		if (inode->direct[k]) {
+			return 0;
+		}
+	}
+	return inode->size == 0 && !(inode->flags & INODE_INLINE) && !inode->indirect && !inode->dindirect && !inode->tindirect;
+}
+
+static void blockmap_drop(struct fs_blockmap *bm)
+{
+	fs.blockmapbytes -= bm->nblocks * (int)sizeof(int);
+	free(bm->map);
+	memset(bm, 0, sizeof(*bm));
+}
+
+// forget the decoded map of an inode (it was deleted)
+static void blockmap_forget(int inumber)
+{
+	int i;
+
+	for (i = 0; i < BLOCKMAP_SLOTS; i++) {
+		if (fs.blockmaps[i].inumber == inumber) {
+			blockmap_drop(&fs.blockmaps[i]);
+		}
+	}
+}
+
+static void blockmap_release()
+{
+	int i;
+
+	for (i = 0; i < BLOCKMAP_SLOTS; i++) {
+		blockmap_drop(&fs.blockmaps[i]);
+	}
+	fs.blockmapclock = 0;
+}
+
+static struct fs_blockmap *blockmap_find(int inumber)
+{
+	int i;
+
+	for (i = 0; i < BLOCKMAP_SLOTS; i++) {
+		if (fs.blockmaps[i].inumber == inumber) {
+			fs.blockmaps[i].lastuse = ++fs.blockmapclock;
+			return &fs.blockmaps[i];
+		}
+	}
+	return NULL;
+}
+
+// evict least recently used maps until a free slot exists and nbytes more fit the budget.
+// returns the free slot, or NULL if the map could never fit.
+static struct fs_blockmap *blockmap_make_room(int nbytes)
+{
+	if (nbytes > BLOCKMAP_BUDGET) {
+		return NULL;
+	}
+
+	while (1) {
+		struct fs_blockmap *victim = NULL, *empty = NULL;
 		int i;
-		tempbytesread = BLOCK_SIZE;
-		for (i = 0; (i < indirectblocks) && (totalbytesread < length); i++)
+
+		for (i = 0; i < BLOCKMAP_SLOTS; i++) {
+			struct fs_blockmap *bm = &fs.blockmaps[i];
+			if (bm->inumber == 0) {
+				empty = bm;
+			}
+			else if (victim == NULL || bm->lastuse < victim->lastuse) {
+				victim = bm;
+			}
+		}
+
+		if (empty && fs.blockmapbytes + nbytes <= BLOCKMAP_BUDGET) {
+			return empty;
+		}
+		blockmap_drop(victim);
+	}
+}
+
+// the decoded map of an inode, decoding it (one indirect block read) on a miss.
+// returns NULL if it cannot be cached, in which case callers decode the inode themselves.
+static struct fs_blockmap *blockmap_get(int inumber, const struct fs_inode *inode)
+{
+	struct fs_blockmap *bm = blockmap_find(inumber);
+	if (bm) {
+		return bm;
+	}
+
+	// preallocated blocks may lie past the end of the file, so keep everything up to the last pointer.
+	// a map that could never fit the budget is not decoded at all
+	int nblocks = inode_span(inode);
+	if (nblocks > BLOCKMAP_BUDGET / (int)sizeof(int)) {
+		return NULL;
+	}
+
+	int *decoded = malloc((nblocks ? nblocks : 1) * sizeof(int));
+	if (decoded == NULL) {
+		return NULL;
+	}
+	inode_map_blocks(inode, 0, nblocks, decoded);
+	while (nblocks > 0 && decoded[nblocks - 1] == 0) {
+		nblocks--;
+	}
+
+	bm = blockmap_make_room(nblocks * sizeof(int));
+	if (bm == NULL) {
+		free(decoded);
+		return NULL;
+	}
+
+	bm->map = decoded;
+	bm->inumber = inumber;
+	bm->nblocks = nblocks;
+	bm->lastuse = ++fs.blockmapclock;
+	fs.blockmapbytes += nblocks * sizeof(int);
+	return bm;
+}
+
+// like inode_map_blocks, but served from the decoded map when there is one
+static void blockmap_lookup(int inumber, const struct fs_inode *inode, int first, int count, int *blocks)
+{
+	struct fs_blockmap *bm = blockmap_get(inumber, inode);
+	int i;
+
+	if (bm == NULL) {
+		inode_map_blocks(inode, first, count, blocks);
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		int n = first + i;
+		blocks[i] = n < bm->nblocks ? bm->map[n] : 0;
+	}
+}
+
+// record blocks fs_write has just mapped, growing the decoded map if the file grew
+static void blockmap_update(int inumber, int first, int count, const int *blocks)
+{
+	struct fs_blockmap *bm = blockmap_find(inumber);
+	if (bm == NULL) {
+		return;
+	}
+
+	if (first + count > bm->nblocks) {
+		int grow = first + count - bm->nblocks;
+		int *map = NULL;
+
+		if (fs.blockmapbytes + grow * (int)sizeof(int) <= BLOCKMAP_BUDGET) {
+			map = realloc(bm->map, (first + count) * sizeof(int));
+		}
+		if (map == NULL) {
+			// too big to keep; the next lookup decodes the inode again
+			blockmap_drop(bm);
+			return;
+		}
+		memset(&map[bm->nblocks], 0, grow * sizeof(int));
+		bm->map = map;
+		bm->nblocks += grow;
+		fs.blockmapbytes += grow * sizeof(int);
+	}
+	memcpy(&bm->map[first], blocks, count * sizeof(int));
+}
+
+// write the superblock back to disk, but only if it has changed since mount
+static void super_sync()
+{
+	BLOCK_BUFFER(block);
+
+	if (!fs.mounted || !fs.superdirty) {
+		return;
+	}
+
+	memset(block->data, 0, BLOCK_SIZE);
+	block->super = fs.super;
+	disk_write(0, block->data);
+	fs.superdirty = 0;
+}
+
+// first block available for file data
+static int data_start()
+{
+	return 1 + fs.super.ninodeblocks + fs.super.nbitmapblocks + fs.super.ninodebitmapblocks + fs.super.nrefblocks + fs.super.nhashblocks;
+}
+
+// is blocknum somewhere a file's data or indirect block may live?
+static int data_block_ok(int blocknum)
+{
+	return blocknum >= data_start() && blocknum < fs.super.nblocks;
+}
+
+// both bitmaps are on disk, so a clean mount need not walk the inodes
+static int bitmaps_persisted()
+{
+	return fs.super.nbitmapblocks > 0 && fs.super.ninodebitmapblocks > 0;
+}
+
+// find the inode block and slot holding an inode; returns 0 if the inumber is out of range
+static int inode_locate(int inumber, int *blocknum, int *index)
+{
+	if (inumber <= 0 || inumber >= fs.super.ninodes) {
+		return 0;
+	}
+
+	*blocknum = inumber / inodes_per_block(fs.super.version) + 1;
+	*index = inumber % inodes_per_block(fs.super.version);
+	return 1;
+}
+
+// how many inode blocks, from block 1 on, may hold live inodes. fs_format leaves the inode
+// table unwritten; fs_create zeroes it a block at a time as inodes are handed out
+static int inode_blocks_initialized(const struct fs_superblock *super)
+{
+	int uninit = __atomic_load_n(&super->inodeuninit, __ATOMIC_ACQUIRE);
+	return uninit > 0 && uninit <= super->ninodeblocks ? uninit - 1 : super->ninodeblocks;
+}
+
+// read an inode block; past the initialized part it holds free inodes only, whatever the disk says
+static void inode_block_read(int blocknum, union fs_block *block)
+{
+	if (blocknum <= inode_blocks_initialized(&fs.super)) {
+		disk_read(blocknum, block->data);
+	}
+	else {
+		memset(block->data, 0, BLOCK_SIZE);
+	}
+}
+
+// zero the unwritten inode blocks up to blocknum and move the mark in the superblock past them
+static void inode_block_init(int blocknum)
+{
+	int first = inode_blocks_initialized(&fs.super) + 1;
+	BLOCK_BUFFER(zero);
+	int i;
+
+	if (blocknum < first) {
+		return;
+	}
+	memset(zero->data, 0, BLOCK_SIZE);
+	for (i = first; i <= blocknum; i++) {
+		disk_write(i, zero->data);
+	}
+	__atomic_store_n(&fs.super.inodeuninit, blocknum < fs.super.ninodeblocks ? blocknum + 1 : 0, __ATOMIC_RELEASE);
+	fs.superdirty = 1;
+	super_sync();
+}
+
+// references to a block past its first; blocks are only shared on disks that count them
+static int refs_get(int blocknum)
+{
+	return fs.refs.entries ? ((uint16_t *)fs.refs.entries)[blocknum] : 0;
+}
+
+// take another reference to a block in use; returns 0 if it cannot be counted
+static int refs_take(int blocknum)
+{
+	uint16_t *counts = (uint16_t *)fs.refs.entries;
+
+	if (counts == NULL || counts[blocknum] == REFS_MAX) {
+		return 0;
+	}
+	counts[blocknum]++;
+	table_mark_dirty(&fs.refs, blocknum);
+	fs.nshared++;
+	return 1;
+}
+
+static void refs_drop(int blocknum)
+{
+	((uint16_t *)fs.refs.entries)[blocknum]--;
+	table_mark_dirty(&fs.refs, blocknum);
+	fs.nshared--;
+}
+
+// make the index twice as big (or start it); returns 0 if there is no memory for that
+static int dedup_grow()
+{
+	struct fs_dedupindex old = fs.dedup;
+	int capacity = old.capacity ? old.capacity * 2 : 1024;
+	int i;
+
+	fs.dedup.slots = calloc(capacity, sizeof(struct fs_dedupslot));
+	if (fs.dedup.slots == NULL) {
+		fs.dedup = old;
+		return 0;
+	}
+	fs.dedup.capacity = capacity;
+	fs.dedup.count = 0;
+
+	for (i = 0; i < old.capacity; i++) {
+		if (old.slots[i].blocknum) {
+			int k = old.slots[i].hash & (capacity - 1);
+			while (fs.dedup.slots[k].blocknum) {
+				k = (k + 1) & (capacity - 1);
+			}
+			fs.dedup.slots[k] = old.slots[i];
+			fs.dedup.count++;
+		}
+	}
+	free(old.slots);
+	return 1;
+}
+
+// a block that had the given hash when it was last written, or 0
+static int dedup_find(uint64_t hash)
+{
+	int mask = fs.dedup.capacity - 1;
+	int k;
+
+	if (fs.dedup.slots == NULL) {
+		return 0;
+	}
+	for (k = hash & mask; fs.dedup.slots[k].blocknum; k = (k + 1) & mask) {
+		if (fs.dedup.slots[k].hash == hash) {
+			return fs.dedup.slots[k].blocknum;
+		}
+	}
+	return 0;
+}
+
+// index a block under its hash, in place of any other block with the same one. the index
+// is only a hint, so without memory to grow it the block simply goes unindexed
+static void dedup_insert(uint64_t hash, int blocknum)
+{
+	int k;
+
+	if ((fs.dedup.count + 1) * 2 > fs.dedup.capacity && !dedup_grow()) {
+		return;
+	}
+
+	int mask = fs.dedup.capacity - 1;
+	for (k = hash & mask; fs.dedup.slots[k].blocknum; k = (k + 1) & mask) {
+		if (fs.dedup.slots[k].hash == hash) {
+			fs.dedup.slots[k].blocknum = blocknum;
+			return;
+		}
+	}
+	fs.dedup.slots[k].hash = hash;
+	fs.dedup.slots[k].blocknum = blocknum;
+	fs.dedup.count++;
+}
+
+// take a block out of the index, moving later entries of the probe sequence back into the gap
+static void dedup_remove(uint64_t hash, int blocknum)
+{
+	int mask = fs.dedup.capacity - 1;
+	int k, j;
+
+	if (fs.dedup.slots == NULL) {
+		return;
+	}
+	for (k = hash & mask; fs.dedup.slots[k].blocknum; k = (k + 1) & mask) {
+		if (fs.dedup.slots[k].hash == hash) {
+			break;
+		}
+	}
+	if (fs.dedup.slots[k].blocknum != blocknum) {
+		return;
+	}
+
+	for (j = (k + 1) & mask; fs.dedup.slots[j].blocknum; j = (j + 1) & mask) {
+		int home = fs.dedup.slots[j].hash & mask;
+
+		// an entry can move back to k only if k is not before its home slot
+		if (((j - home) & mask) >= ((j - k) & mask)) {
+			fs.dedup.slots[k] = fs.dedup.slots[j];
+			k = j;
+		}
+	}
+	fs.dedup.slots[k].blocknum = 0;
+	fs.dedup.count--;
+}
+
+// the block's contents are no longer known (or it is no longer in use)
+static void hash_forget(int blocknum)
+{
+	uint64_t *hashes = (uint64_t *)fs.hashes.entries;
+
+	if (hashes == NULL || hashes[blocknum] == 0) {
+		return;
+	}
+	dedup_remove(hashes[blocknum], blocknum);
+	hashes[blocknum] = 0;
+	table_mark_dirty(&fs.hashes, blocknum);
+}
+
+// the block is being written with contents of the given hash
+static void hash_record(int blocknum, uint64_t hash)
+{
+	uint64_t *hashes = (uint64_t *)fs.hashes.entries;
+
+	if (hashes == NULL) {
+		return;
+	}
+	hash_forget(blocknum);
+	hashes[blocknum] = hash;
+	table_mark_dirty(&fs.hashes, blocknum);
+	dedup_insert(hash, blocknum);
+}
+
+static uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+// a 64-bit hash of a block's contents, never 0. four independent lanes, each taking every
+// fourth word, keep the multiplies in flight together (or in one vector register)
+static uint64_t block_hash(const char *data)
+{
+	const uint64_t p1 = 0x9e3779b185ebca87ULL, p2 = 0xc2b2ae3d27d4eb4fULL;
+	uint64_t lanes[4] = { p1 + p2, p2, 0, -p1 };
+	int i, k;
+
+	for (i = 0; i < BLOCK_SIZE; i += 4 * sizeof(uint64_t)) {
+		for (k = 0; k < 4; k++) {
+			uint64_t word;
+			memcpy(&word, &data[i + k * sizeof(uint64_t)], sizeof(word));
+			lanes[k] = rotl64(lanes[k] + word * p2, 31) * p1;
+		}
+	}
+
+	uint64_t h = rotl64(lanes[0], 1) + rotl64(lanes[1], 7) + rotl64(lanes[2], 12) + rotl64(lanes[3], 18);
+	h ^= h >> 33;
+	h *= p2;
+	h ^= h >> 29;
+	h *= p1;
+	h ^= h >> 32;
+	return h ? h : 1;
+}
+
+// write back everything block allocation keeps in memory
+static void blocks_sync()
+{
+	bitmap_sync(&fs.bitmap);
+	table_sync(&fs.refs);
+	table_sync(&fs.hashes);
+}
+
+// drop a reference to a data block, returning it to the free pool with the last one;
+// metadata blocks are never released
+void releaseBlock(int blocknum) {
+	if (blocknum < data_start()) {
+		return;
+	}
+	if (refs_get(blocknum) > 0) {
+		refs_drop(blocknum);
+		return;
+	}
+	hash_forget(blocknum);
+	bitmap_clear(&fs.bitmap, blocknum);
+}
+
+int getInodeNumber(int blockindex, int inodeindex, int perblock) {
+	int temp = ((blockindex - 1) * perblock) + inodeindex;
+	return temp;
+}
+
+static int compressdata = 0;	// whether fs_format makes a compressed filesystem
+
+void fs_compress_config(int enable)
+{
+	compressdata = enable;
+}
+
+static int dedupdata = 0;	// whether fs_format makes a filesystem that shares identical blocks
+
+void fs_dedup_config(int enable)
+{
+	dedupdata = enable;
+}
+
+int fs_format()
+{
+
+	// create a new file system
+	BLOCK_BUFFER(superblock);
+
+	// return failure on attempt to format an already-mounted disk
+	if (fs.mounted) {
+		printf("simplefs: Error! Cannot format an already-mounted disk.\n");
+		return 0;
+	}
+
+	// a compressed cluster's blocks only mean something together, so they are never shared
+	if (compressdata && dedupdata) {
+		printf("simplefs: Error! Compression and deduplication cannot be combined.\n");
+		return 0;
+	}
+
+	// the filesystem takes the block size the disk was opened with
+	fs.blocksize = disk_block_size();
+
+	/* Write the superblock */
+	memset(superblock->data, 0, BLOCK_SIZE);
+	superblock->super.magic = FS_MAGIC;
+	superblock->super.version = FS_VERSION;
+	superblock->super.blocksize = BLOCK_SIZE;
+	superblock->super.compress = compressdata;
+	superblock->super.nblocks = disk_size();
+
+	// set aside ten percent of the blocks for inodes
+	if (superblock->super.nblocks % 10 == 0) {
+		superblock->super.ninodeblocks = superblock->super.nblocks/10;
+	}
+	// round up
+	else {
+		superblock->super.ninodeblocks = superblock->super.nblocks/10 + 1;
+	}
+	
+	// the inode count has to fit an int as well
+	if (superblock->super.ninodeblocks > INT_MAX / INODES_PER_BLOCK_V4) {
+		superblock->super.ninodeblocks = INT_MAX / INODES_PER_BLOCK_V4;
+	}
+	
+	superblock->super.ninodes = INODES_PER_BLOCK_V4 * superblock->super.ninodeblocks;
+
+	// the free-block bitmap follows the inode blocks
+	superblock->super.nbitmapblocks = (superblock->super.nblocks + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+	superblock->super.ninodebitmapblocks = (superblock->super.ninodes + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+	superblock->super.clean = 1;
+
+	// then a reference count for every block and, to find copies of a block, its hash
+	superblock->super.nrefblocks = ((long long)superblock->super.nblocks * sizeof(uint16_t) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	superblock->super.nhashblocks = dedupdata ? ((long long)superblock->super.nblocks * sizeof(uint64_t) + BLOCK_SIZE - 1) / BLOCK_SIZE : 0;
+
+	int reserved = 1 + superblock->super.ninodeblocks + superblock->super.nbitmapblocks + superblock->super.ninodebitmapblocks +
+		superblock->super.nrefblocks + superblock->super.nhashblocks;
+	if (reserved > superblock->super.nblocks) {
+		printf("simplefs: Error! Disk is too small to format.\n");
+		return 0;
+	}
+
+	// the inode blocks are not cleared here, which would take time in proportion to the
+	// disk: whatever they hold reads as free inodes until fs_create first needs them
+	superblock->super.inodeuninit = superblock->super.ninodeblocks > 0 ? 1 : 0;
+
+	// write the superblock to disk
+	disk_write(0, superblock->data);
+
+	int i;
+
+	// write out a bitmap in which only the metadata blocks are in use
+	struct fs_bitmap bitmap;
+	if (!bitmap_init(&bitmap, superblock->super.nblocks) ||
+	    !bitmap_attach(&bitmap, superblock->super.ninodeblocks + 1, superblock->super.nbitmapblocks)) {
+		printf("simplefs: Error! Unable to allocate the bitmap.\n");
+		bitmap_free(&bitmap);
+		return 0;
+	}
+	for (i = 0; i < reserved; i++) {
+		bitmap_set(&bitmap, i);
+	}
+	memset(bitmap.dirty, 1, bitmap.ndiskblocks);
+	bitmap_sync(&bitmap);
+	bitmap_free(&bitmap);
+
+	// and an inode bitmap in which only the reserved inode 0 is taken
+	if (!bitmap_init(&bitmap, superblock->super.ninodes) ||
+	    !bitmap_attach(&bitmap, superblock->super.ninodeblocks + 1 + superblock->super.nbitmapblocks, superblock->super.ninodebitmapblocks)) {
+		printf("simplefs: Error! Unable to allocate the bitmap.\n");
+		bitmap_free(&bitmap);
+		return 0;
+	}
+	bitmap_set(&bitmap, 0);
+	memset(bitmap.dirty, 1, bitmap.ndiskblocks);
+	bitmap_sync(&bitmap);
+	bitmap_free(&bitmap);
+
+	// no block is shared, and no block's contents are known
+	int tables = superblock->super.nrefblocks + superblock->super.nhashblocks;
+	memset(superblock->data, 0, BLOCK_SIZE);
+	for (i = reserved - tables; i < reserved; i++) {
+		disk_write(i, superblock->data);
+	}
+	
+	return 1;
+}
+
+static int scanthreads = 0;	// 0: one per online processor
+
+void fs_scan_config(int nthreads)
+{
+	scanthreads = nthreads < 0 ? 0 : nthreads;
+}
+
+// one worker's share of an inode table scan: inode blocks first..last
+struct fs_scanjob {
+	int first;
+	int last;
+	int version;	// format of the inodes (fs_debug may look at an unmounted disk)
+	struct fs_bitmap *bitmap;	// where fs_mount's scan marks blocks and inodes in use
+	struct fs_bitmap *inodemap;
+	struct fs_bitmap partbitmap;	// private partial bitmaps, merged once every worker is done
+	struct fs_bitmap partinodemap;
+	char *text;	// fs_debug's report for the range
+	size_t textlen;
+	struct fs_bitmap partdup;	// fs_fsck: blocks referenced more than once within the range
+	struct fs_bitmap partbad;	// fs_fsck: inodes with a bad pointer or size
+	uint32_t *counts;	// on disks with reference counts: references to each block, shared by all workers
+};
+
+// how many workers to split ninodeblocks inode blocks across
+static int scan_threads(int ninodeblocks)
+{
+	int n = scanthreads;
+	if (n <= 0) {
+		long online = sysconf(_SC_NPROCESSORS_ONLN);
+		n = online > 0 ? online : 1;
+	}
+	if (n > SCAN_MAX_THREADS) {
+		n = SCAN_MAX_THREADS;
+	}
+	if (n > ninodeblocks / SCAN_MIN_BLOCKS) {
+		n = ninodeblocks / SCAN_MIN_BLOCKS;
+	}
+	return n < 1 ? 1 : n;
+}
+
+// split inode blocks 1..ninodeblocks evenly across njobs jobs and run work on each of them,
+// the first in this thread. a worker that cannot be started is run here as well.
+static void scan_run(struct fs_scanjob *jobs, int njobs, int ninodeblocks, void *(*work)(void *))
+{
+	pthread_t threads[SCAN_MAX_THREADS];
+	int started[SCAN_MAX_THREADS];
+	int i;
+
+	for (i = 0; i < njobs; i++) {
+		jobs[i].first = 1 + (long long)ninodeblocks * i / njobs;
+		jobs[i].last = (long long)ninodeblocks * (i + 1) / njobs;
+	}
+
+	for (i = 1; i < njobs; i++) {
+		started[i] = pthread_create(&threads[i], NULL, work, &jobs[i]) == 0;
+	}
+	work(&jobs[0]);
+	for (i = 1; i < njobs; i++) {
+		if (started[i]) {
+			pthread_join(threads[i], NULL);
+		}
+		else {
+			work(&jobs[i]);
+		}
+	}
+}
+
+// list the disk blocks behind file blocks [first, last)
+static void debug_data_blocks(FILE *out, const struct fs_inode *inode, const char *what, int first, int last)
+{
+	BLOCK_BUFFER(pointers);
+	int *blocks = pointers->pointers;
+
+	fprintf(out, "\t%s data blocks:", what);
+	while (first < last) {
+		int count = last - first < POINTERS_PER_BLOCK ? last - first : POINTERS_PER_BLOCK;
+		int l;
+
+		inode_map_blocks(inode, first, count, blocks);
+		for (l = 0; l < count; l++) {
+			fprintf(out, " %d", blocks[l]);
+		}
+		first += count;
+	}
+	fprintf(out, "\n");
+}
+
+static void debug_inode(FILE *out, const struct fs_inode *inode, int inumber)
+{
+	fprintf(out, "inode %d:\n", inumber);
+	fprintf(out, "\tsize: %lld bytes\n", inode->size);
+	if (inode->flags & INODE_INLINE) {
+		fprintf(out, "\tdata inline in the inode\n");
+		return;
+	}
+
+	// go through all 5 direct pointers to data blocks
+	fprintf(out, "\tdirect blocks:");
+	int k;
+	for (k = 0; (k * BLOCK_SIZE < inode->size) && (k < 5); k++) {
+		fprintf(out, " %d", inode->direct[k]);
+	}
+	fprintf(out, "\n");
+
+	// then each pointer block tree the size reaches into (the indirect block once the size is
+	// greater than the total size of 5 direct blocks)
+	int limit = file_blocks_limit(FS_VERSION);
+	int nblocks = inode->size > (long long)limit * BLOCK_SIZE ? limit : size_to_blocks(inode->size);
+	int start = POINTERS_PER_INODE;
+	int level;
+	for (level = 1; level <= 3 && nblocks > start; level++) {
+		static const char *names[] = { "indirect", "double indirect", "triple indirect" };
+		int end = start + level_span(level + 1) > nblocks ? nblocks : start + level_span(level + 1);
+
+		fprintf(out, "\t%s block: %d\n", names[level - 1], inode_root(inode, level));
+		debug_data_blocks(out, inode, names[level - 1], start, end);
+		start = end;
+	}
+}
+
+// report every valid inode in inode blocks first..last
+static void debug_inode_blocks(FILE *out, int first, int last, int version)
+{
+	BLOCK_BUFFER(inodeblock);
+	struct fs_inode inode;
+	int i;
+
+	for (i = first; i <= last; i++) {
+		const union fs_block *inodes = block_view(i, inodeblock);
+
+		// loop through every inode in the block
+		int j;
+		for (j = 0; j < inodes_per_block(version); j++) {
+			inode_load(inodes, version, j, &inode);
+			if (inode.isvalid) {
+				debug_inode(out, &inode, getInodeNumber(i, j, inodes_per_block(version)));
+			}
+		}
+	}
+}
+
+// fs_debug worker: write the range up in memory. text stays NULL if that is impossible,
+// and the range is then reported directly afterwards.
+static void *debug_worker(void *arg)
+{
+	struct fs_scanjob *job = arg;
+	FILE *out = open_memstream(&job->text, &job->textlen);
+
+	if (out == NULL) {
+		job->text = NULL;
+		return NULL;
+	}
+	debug_inode_blocks(out, job->first, job->last, job->version);
+	if (fclose(out) != 0) {
+		free(job->text);
+		job->text = NULL;
+	}
+	return NULL;
+}
+
+void fs_debug()
+{
+	/* Scan a mounted filesystem */
+	BLOCK_BUFFER(block);
+
+	// buffered writes have to be on disk before we can show them
+	if (fs.mounted) {
+		writebuf_flush_all();
+	}
+	else {
+		fs.blocksize = disk_block_size();
+	}
+	disk_read(0, block->data);
+
+	printf("superblock:\n");
+
+	if (block->super.magic == FS_MAGIC) {
+		printf("magic number is valid\n");
+	}
+	else {
+		printf("simplefs: Error! Magic number is invalid.\n");
+		return;
+	}
+
+	printf("\t%d blocks on disk\n", block->super.nblocks);
+	printf("\t%d blocks for inodes\n", block->super.ninodeblocks);
+	printf("\t%d inodes total\n", block->super.ninodes);
+	if (block->super.inodeuninit > 0) {
+		printf("\t%d inode blocks initialized\n", inode_blocks_initialized(&block->super));
+	}
+	if (block->super.version > 0) {
+		printf("\tformat version %d\n", block->super.version);
+	}
+	if (block->super.blocksize > 0) {
+		printf("\t%d bytes per block\n", block->super.blocksize);
+	}
+	if (block->super.compress) {
+		printf("\tdata compressed in clusters of %d blocks\n", COMPRESS_CLUSTER);
+		if (fs.mounted && fs.nclusters > 0) {
+			printf("\t%lld clusters compressed into %lld blocks since mounting (%.2f:1)\n", fs.nclusters, fs.nclusterblocks, (double)fs.nclusters * COMPRESS_CLUSTER / fs.nclusterblocks);
+		}
+		if (fs.mounted && fs.nrawclusters > 0) {
+			printf("\t%lld clusters stored uncompressed since mounting\n", fs.nrawclusters);
+		}
+	}
+	// unmounted, the disk can follow the filesystem's block size
+	if (superblock_block_size(&block->super) != disk_block_size() && (fs.mounted || !disk_block_size_change(superblock_block_size(&block->super)))) {
+		printf("simplefs: Error! Disk was formatted with %d-byte blocks, not %d.\n", superblock_block_size(&block->super), disk_block_size());
+		return;
+	}
+	fs.blocksize = disk_block_size();
+
+	// unmounted, the pointers below are checked against the superblock being shown
+	if (!fs.mounted) {
+		fs.super = block->super;
+	}
+	if (block->super.nbitmapblocks > 0) {
+		printf("\t%d blocks for the free-block bitmap\n", block->super.nbitmapblocks);
+		printf("\t%d blocks for the free-inode bitmap\n", block->super.ninodebitmapblocks);
+		if (block->super.nrefblocks > 0) {
+			printf("\t%d blocks for reference counts\n", block->super.nrefblocks);
+		}
+		if (block->super.nhashblocks > 0) {
+			printf("\t%d blocks for block hashes, for deduplication\n", block->super.nhashblocks);
+		}
+		printf("\t%s\n", block->super.clean ? "cleanly unmounted" : "not cleanly unmounted");
+	}
+
+	/* Report on how the inodes are organized */
+
+	// each worker writes up its share of the inode blocks, which are then printed in order
+	struct fs_scanjob jobs[SCAN_MAX_THREADS];
+	int ninodeblocks = inode_blocks_initialized(&block->super);
+	int njobs = scan_threads(ninodeblocks);
+	int i;
+
+	memset(jobs, 0, sizeof(jobs));
+	for (i = 0; i < njobs; i++) {
+		jobs[i].version = block->super.version;
+	}
+	scan_run(jobs, njobs, ninodeblocks, debug_worker);
+	for (i = 0; i < njobs; i++) {
+		if (jobs[i].text) {
+			fwrite(jobs[i].text, 1, jobs[i].textlen, stdout);
+			free(jobs[i].text);
+		}
+		else {
+			debug_inode_blocks(stdout, jobs[i].first, jobs[i].last, jobs[i].version);
+		}
+	}
+}
+
+// call visit on blocknum, a pointer block of the given level (0 for a data block), and, unless
+// it returns 0, on every block below it. a pointer block other files share is only walked once
+// that way. a pointer out of range is left for fsck, as is everything below it
+static void pointer_walk(int blocknum, int level, int (*visit)(int blocknum, void *arg), void *arg)
+{
+	BLOCK_BUFFER(scratch);
+	int k;
+
+	if (!data_block_ok(blocknum) || !visit(blocknum, arg) || level == 0) {
+		return;
+	}
+	const union fs_block *block = block_view(blocknum, scratch);
+	int used = pointers_used(block->pointers);
+	for (k = 0; k < used; k++) {
+		if (block->pointers[k]) {
+			pointer_walk(block->pointers[k], level - 1, visit, arg);
+		}
+	}
+}
+
+// call visit on every block an inode points to, pointer blocks included. every pointer counts,
+// not just those below the size: blocks can be preallocated
+static void inode_walk(const struct fs_inode *inode, int (*visit)(int blocknum, void *arg), void *arg)
+{
+	int k;
+
+	for (k = 0; k < POINTERS_PER_INODE; k++) {
+		if (inode->direct[k]) {
+			pointer_walk(inode->direct[k], 0, visit, arg);
+		}
+	}
+	for (k = 1; k <= 3; k++) {
+		if (inode_root(inode, k)) {
+			pointer_walk(inode_root(inode, k), k, visit, arg);
+		}
+	}
+}
+
+// count a reference to a block in a table all workers share; returns the references
+// counted before this one
+static uint32_t scan_count(uint32_t *counts, int blocknum)
+{
+	if (counts && blocknum >= 0 && blocknum < fs.super.nblocks) {
+		return __atomic_fetch_add(&counts[blocknum], 1, __ATOMIC_RELAXED);
+	}
+	return 0;
+}
+
+// the blocks below a shared pointer block are counted once, by the first worker to reach it
+static int scan_mark(int blocknum, void *arg)
+{
+	struct fs_scanjob *job = arg;
+
+	bitmap_set(job->bitmap, blocknum);
+	return scan_count(job->counts, blocknum) == 0;
+}
+
+// mark the blocks an inode points to and the inode itself
+static void scan_inode(const struct fs_inode *inode, int inumber, struct fs_scanjob *job)
+{
+	bitmap_set(job->inodemap, inumber);
+	inode_walk(inode, scan_mark, job);
+}
+
+// fs_mount worker: walk the job's inode blocks, marking its own bitmaps
+static void *scan_worker(void *arg)
+{
+	struct fs_scanjob *job = arg;
+	BLOCK_BUFFER(inode_block);
+	struct fs_inode inode;
+	int perblock = inodes_per_block(fs.super.version);
+	int i;
+
+	for (i = job->first; i <= job->last; i++) {
+		const union fs_block *inodes = block_view(i, inode_block);
+		int j;
+		for (j = 0; j < perblock; j++) { //loops through inodes in each inode block.
+			inode_load(inodes, fs.super.version, j, &inode);
+			if (inode.isvalid) {
+				scan_inode(&inode, getInodeNumber(i, j, perblock), job);
+			}
+		}
+	}
+	return NULL;
+}
+
+// rebuild both bitmaps, and any reference counts, from the inode table. with several workers
+// each fills private partial bitmaps, which are OR-ed together at the end.
+static void bitmap_scan(struct fs_bitmap *bitmap, struct fs_bitmap *inodemap)
+{
+	struct fs_scanjob jobs[SCAN_MAX_THREADS];
+	int ninodeblocks = inode_blocks_initialized(&fs.super);
+	int njobs = scan_threads(ninodeblocks);
+	uint32_t *counts = NULL;
+	int i;
+
+	// without the memory to count the references, the counts on disk have to do
+	if (fs.refs.entries && (counts = calloc(fs.super.nblocks, sizeof(uint32_t))) == NULL) {
+		printf("simplefs: Error! Unable to recount the block references.\n");
+	}
+
+	// the superblock, the inode blocks and the bitmaps themselves are always in use
+	for (i = 0; i < data_start(); i++) {
+		bitmap_set(bitmap, i);
+	}
+	bitmap_set(inodemap, 0);
+
+	memset(jobs, 0, sizeof(jobs));
+	for (i = 0; i < njobs && njobs > 1; i++) {
+		if (!bitmap_init(&jobs[i].partbitmap, bitmap->nbits) || !bitmap_init(&jobs[i].partinodemap, inodemap->nbits)) {
+			// not enough memory for private copies: do it all in this thread
+			for (; i >= 0; i--) {
+				bitmap_free(&jobs[i].partbitmap);
+				bitmap_free(&jobs[i].partinodemap);
+			}
+			njobs = 1;
+			break;
+		}
+		jobs[i].bitmap = &jobs[i].partbitmap;
+		jobs[i].inodemap = &jobs[i].partinodemap;
+	}
+	if (njobs == 1) {
+		jobs[0].bitmap = bitmap;
+		jobs[0].inodemap = inodemap;
+	}
+	for (i = 0; i < njobs; i++) {
+		jobs[i].counts = counts;
+	}
+
+	scan_run(jobs, njobs, ninodeblocks, scan_worker);
+
+	if (counts) {
+		for (i = 0; i < fs.super.nblocks; i++) {
+			int extra = counts[i] > 1 ? counts[i] - 1 : 0;
+			((uint16_t *)fs.refs.entries)[i] = extra < REFS_MAX ? extra : REFS_MAX;
+		}
+		memset(fs.refs.dirty, 1, fs.refs.ndiskblocks);
+		free(counts);
+	}
+
+	if (njobs > 1) {
+		for (i = 0; i < njobs; i++) {
+			bitmap_merge(bitmap, &jobs[i].partbitmap);
+			bitmap_merge(inodemap, &jobs[i].partinodemap);
+			bitmap_free(&jobs[i].partbitmap);
+			bitmap_free(&jobs[i].partinodemap);
+		}
+		bitmap_recount(bitmap);
+		bitmap_recount(inodemap);
+	}
+}
+
+int fs_mount() 
+{
+
+	// refuse to mount twice
+	if (fs.mounted) {
+		printf("simplefs: Error! Disk is already mounted.\n");
+		return 0;
+	}
+
+	// read the superblock once; every later operation uses this copy. it sits at the start
+	// of block 0 whatever the block size, so any size reads it
+	BLOCK_BUFFER(block);
+	disk_read(0, block->data); 
+
+	if (block->super.magic != FS_MAGIC) {
+		printf("simplefs: Error! Magic number is invalid.\n");
+		return 0;
+	}
+	if (block->super.version > FS_VERSION) {
+		printf("simplefs: Error! Unsupported format version %d.\n", block->super.version);
+		return 0;
+	}
+	// the filesystem says what size its blocks are, whatever the disk was opened with
+	if (superblock_block_size(&block->super) != disk_block_size() && !disk_block_size_change(superblock_block_size(&block->super))) {
+		printf("simplefs: Error! Disk was formatted with %d-byte blocks, not %d.\n", superblock_block_size(&block->super), disk_block_size());
+		return 0;
+	}
+
+	fs.blocksize = disk_block_size();
+	fs.super = block->super;
+	fs.superdirty = 0;
+	fs.nclusters = 0;
+	fs.nclusterblocks = 0;
+	fs.nrawclusters = 0;
+
+	int i;
+	for (i = 0; i < INODE_LOCKS; i++) {
+		pthread_rwlock_init(&fs.inodelocks[i], NULL);
+	}
+	for (i = 0; i < READAHEAD_SLOTS; i++) {
+		pthread_mutex_init(&fs.readahead[i].busy, NULL);
+	}
+
+	// create the free-block bitmap in memory, one bit per block, and the free-inode bitmap
+	struct fs_bitmap *bitmap = &fs.bitmap;
+	struct fs_bitmap *inodemap = &fs.inodemap;
+	if (!bitmap_init(bitmap, fs.super.nblocks) ||
+	    !bitmap_init(inodemap, fs.super.ninodes) ||
+	    (fs.super.nbitmapblocks > 0 && !bitmap_attach(bitmap, fs.super.ninodeblocks + 1, fs.super.nbitmapblocks)) ||
+	    (fs.super.ninodebitmapblocks > 0 && !bitmap_attach(inodemap, fs.super.ninodeblocks + 1 + fs.super.nbitmapblocks, fs.super.ninodebitmapblocks))) {
+		printf("simplefs: Error! Unable to allocate the bitmap.\n");
+		bitmap_free(bitmap);
+		bitmap_free(inodemap);
+		return 0;
+	}
+
+	// and the reference counts and block hashes that follow, on disks that have them
+	int tables = data_start() - fs.super.nrefblocks - fs.super.nhashblocks;
+	if ((fs.super.nrefblocks > 0 && !table_init(&fs.refs, fs.super.nblocks, sizeof(uint16_t), tables, fs.super.nrefblocks)) ||
+	    (fs.super.nhashblocks > 0 && !table_init(&fs.hashes, fs.super.nblocks, sizeof(uint64_t), tables + fs.super.nrefblocks, fs.super.nhashblocks))) {
+		printf("simplefs: Error! Unable to allocate the reference counts.\n");
+		bitmap_free(bitmap);
+		bitmap_free(inodemap);
+		table_free(&fs.refs);
+		table_free(&fs.hashes);
+		return 0;
+	}
+
+	if (bitmaps_persisted() && fs.super.clean) {
+		// clean unmount: the on-disk bitmaps are trustworthy
+		bitmap_load(bitmap);
+		bitmap_load(inodemap);
+		if (fs.refs.entries) {
+			table_load(&fs.refs);
+		}
+		if (fs.hashes.entries) {
+			table_load(&fs.hashes);
+		}
+	}
+	else {
+		// older image, or a crash while mounted: rebuild and rewrite both bitmaps, and the
+		// reference counts. the block hashes may be stale, but only ever lead to a block
+		// that is compared before it is shared
+		if (fs.super.nbitmapblocks > 0) {
+			printf("simplefs: disk was not cleanly unmounted, rebuilding the bitmap.\n");
+		}
+		if (fs.refs.entries) {
+			table_load(&fs.refs);
+		}
+		if (fs.hashes.entries) {
+			table_load(&fs.hashes);
+		}
+		bitmap_scan(bitmap, inodemap);
+		if (bitmap->dirty) {
+			memset(bitmap->dirty, 1, bitmap->ndiskblocks);
+		}
+		if (inodemap->dirty) {
+			memset(inodemap->dirty, 1, inodemap->ndiskblocks);
+		}
+	}
+
+	// until fs_unmount the on-disk bitmap may lag behind, so clear the clean flag first
+	if (fs.super.nbitmapblocks > 0) {
+		fs.super.clean = 0;
+		fs.superdirty = 1;
+	}
+
+	// the blocks in use with a known hash make up the deduplication index
+	fs.nshared = 0;
+	memset(&fs.dedup, 0, sizeof(fs.dedup));
+	for (i = 0; i < fs.super.nblocks; i++) {
+		fs.nshared += refs_get(i);
+		if (fs.hashes.entries && ((uint64_t *)fs.hashes.entries)[i]) {
+			if (bitmap_test(bitmap, i)) {
+				dedup_insert(((uint64_t *)fs.hashes.entries)[i], i);
+			}
+			else {
+				hash_forget(i);
+			}
+		}
+	}
+
+	fs.mounted = 1;
+	super_sync();
+	blocks_sync();
+	bitmap_sync(inodemap);
+	disk_flush();
+	return 1;
+}
+
+int fs_unmount()
+{
+	if (!fs.mounted) {
+		return 0;
+	}
+
+	writebuf_flush_all();
+	blocks_sync();
+	bitmap_sync(&fs.inodemap);
+	if (fs.super.nbitmapblocks > 0) {
+		fs.super.clean = 1;
+		fs.superdirty = 1;
+	}
+	super_sync();
+	disk_flush();
+
+	bitmap_free(&fs.bitmap);
+	bitmap_free(&fs.inodemap);
+	table_free(&fs.refs);
+	table_free(&fs.hashes);
+	free(fs.dedup.slots);
+	memset(&fs.dedup, 0, sizeof(fs.dedup));
+	readahead_release();
+	blockmap_release();
+	writebuf_release();
+
+	int i;
+	for (i = 0; i < INODE_LOCKS; i++) {
+		pthread_rwlock_destroy(&fs.inodelocks[i]);
+	}
+	for (i = 0; i < READAHEAD_SLOTS; i++) {
+		pthread_mutex_destroy(&fs.readahead[i].busy);
+	}
+	fs.mounted = 0;
+	return 1;
+}
+
+void fs_sync()
+{
+	if (fs.mounted) {
+		writebuf_flush_all();
+		pthread_mutex_lock(&fs.lock);
+		blocks_sync();
+		bitmap_sync(&fs.inodemap);
+		super_sync();
+		pthread_mutex_unlock(&fs.lock);
+	}
+	disk_flush();
+}
+
+int fs_dedup_stats(long long *savedblocks, long long *indexbytes)
+{
+	if (!fs.mounted || fs.hashes.entries == NULL) {
+		printf("simplefs: Error! No mounted disk with deduplication.\n");
+		return 0;
+	}
+
+	// buffered writes may still find copies of their blocks
+	writebuf_flush_all();
+
+	// the index is the table of slots, plus the hash of every block it is built from
+	pthread_mutex_lock(&fs.lock);
+	*savedblocks = fs.nshared;
+	*indexbytes = (long long)fs.dedup.capacity * sizeof(struct fs_dedupslot) + (long long)fs.hashes.n * fs.hashes.entrysize;
+	pthread_mutex_unlock(&fs.lock);
+	return 1;
+}
+
+/* Consistency check */
+
+// note a reference to a block while scanning; the second one makes it a duplicate, unless
+// the disk counts references, which are then checked against the counts. returns whether
+// the block had been seen before
+static int fsck_claim(struct fs_scanjob *job, int blocknum)
+{
+	if (job->counts) {
+		bitmap_set(&job->partbitmap, blocknum);
+		return scan_count(job->counts, blocknum) > 0;
+	}
+	if (bitmap_test(&job->partbitmap, blocknum)) {
+		bitmap_set(&job->partdup, blocknum);
+		return 1;
+	}
+	bitmap_set(&job->partbitmap, blocknum);
+	return 0;
+}
+
+// the walk over one inode's pointers, in either pass
+struct fs_fsckwalk {
+	int inumber;
+	struct fs_scanjob *job;	// first pass: where the blocks in use are recorded
+	const struct fs_bitmap *dup;	// second pass: the blocks in use more than once,
+	struct fs_bitmap *claimed;	// and those of them an inode has kept already
+	int repair;
+	int problems;
+	int bad;	// first pass: a pointer is out of range
+	int rewritten;	// second pass: a pointer block was repaired
+	int seen;	// the block fsck_keep last kept had been reached before
+};
+
+// decide whether an inode keeps its reference to blocknum. the first pass only flags what is
+// out of range; the second reports that and blocks an earlier inode already holds.
+static int fsck_keep(struct fs_fsckwalk *w, int blocknum)
+{
+	if (!data_block_ok(blocknum)) {
+		if (w->job) {
+			w->bad = 1;
+		}
+		else {
+			printf("simplefs: inode %d points to block %d, which is out of range.\n", w->inumber, blocknum);
+			w->problems++;
+		}
+		return 0;
+	}
+
+	w->seen = 0;
+	if (w->job) {
+		w->seen = fsck_claim(w->job, blocknum);
+	}
+	else if (bitmap_test(w->dup, blocknum)) {
+		if (bitmap_test(w->claimed, blocknum)) {
+			printf("simplefs: inode %d points to block %d, which is already in use.\n", w->inumber, blocknum);
+			w->problems++;
+			return 0;
+		}
+		bitmap_set(w->claimed, blocknum);
+	}
+	else if (fs.refs.entries) {
+		// with counted references nothing is a duplicate, and claimed only tracks the visits
+		w->seen = bitmap_test(w->claimed, blocknum);
+		bitmap_set(w->claimed, blocknum);
+	}
+	return 1;
+}
+
+// check a pointer to a data block (level 0) or to a pointer block of the given level, and
+// everything below it. returns 0 if it has to go.
+static int fsck_tree(struct fs_fsckwalk *w, int blocknum, int level)
+{
+	if (!fsck_keep(w, blocknum)) {
+		return 0;
+	}
+	// a pointer block files share is checked (and repaired) from the first of them only
+	if (level == 0 || (fs.refs.entries && w->seen)) {
+		return 1;
+	}
+
+	BLOCK_BUFFER(block);
+	int dirty = 0;
+	int k;
+
+	disk_read(blocknum, block->data);
+	for (k = 0; k < POINTERS_PER_BLOCK; k++) {
+		if (block->pointers[k] && !fsck_tree(w, block->pointers[k], level - 1) && w->repair) {
+			block->pointers[k] = 0;
+			dirty = 1;
+		}
+	}
+	if (dirty) {
+		disk_write(blocknum, block->data);
+		w->rewritten = 1;
+	}
+	return 1;
+}
+
+// walk all of an inode's pointers in file order; when repairing, the bad ones are cleared.
+// returns 1 if the inode itself was changed.
+static int fsck_pointers(struct fs_fsckwalk *w, struct fs_inode *inode)
+{
+	int *roots[3] = { &inode->indirect, &inode->dindirect, &inode->tindirect };
+	int changed = 0;
+	int k;
+
+	for (k = 0; k < POINTERS_PER_INODE; k++) {
+		if (inode->direct[k] && !fsck_tree(w, inode->direct[k], 0) && w->repair) {
+			inode->direct[k] = 0;
+			changed = 1;
+		}
+	}
+	for (k = 0; k < 3; k++) {
+		if (*roots[k] && !fsck_tree(w, *roots[k], k + 1) && w->repair) {
+			*roots[k] = 0;
+			changed = 1;
+		}
+	}
+	return changed;
+}
+
+// blocks missing below the size are fine (they read back as zeros), but the size has to be in range
+static int fsck_size_ok(const struct fs_inode *inode)
+{
+	return inode->size >= 0 && inode->size <= inode_size_limit(inode);
+}
+
+// fs_fsck worker: record the blocks and inodes in use and flag every inode that has
+// an out-of-range pointer or a size it cannot have
+static void *fsck_worker(void *arg)
+{
+	struct fs_scanjob *job = arg;
+	BLOCK_BUFFER(inode_block);
+	struct fs_inode inode;
+	int perblock = inodes_per_block(fs.super.version);
+	int i;
+
+	for (i = job->first; i <= job->last; i++) {
+		const union fs_block *inodes = block_view(i, inode_block);
+		int j;
+		for (j = 0; j < perblock; j++) {
+			inode_load(inodes, fs.super.version, j, &inode);
+			if (!inode.isvalid) {
+				continue;
+			}
+
+			struct fs_fsckwalk w;
+			memset(&w, 0, sizeof(w));
+			w.inumber = getInodeNumber(i, j, perblock);
+			w.job = job;
+
+			bitmap_set(&job->partinodemap, w.inumber);
+			fsck_pointers(&w, &inode);
+			if (w.bad || !fsck_size_ok(&inode)) {
+				bitmap_set(&job->partbad, w.inumber);
+			}
+		}
+	}
+	return NULL;
+}
+
+// report what is wrong with one inode and, when repairing, drop the bad references and bring
+// the size back into range. returns 1 if anything of it was changed.
+static int fsck_inode(struct fs_inode *inode, int inumber, const struct fs_bitmap *dup, struct fs_bitmap *claimed, int repair, int *problems)
+{
+	struct fs_fsckwalk w;
+
+	memset(&w, 0, sizeof(w));
+	w.inumber = inumber;
+	w.dup = dup;
+	w.claimed = claimed;
+	w.repair = repair;
+	int changed = fsck_pointers(&w, inode);
+
+	if (!fsck_size_ok(inode)) {
+		printf("simplefs: inode %d has an invalid size of %lld bytes.\n", inumber, inode->size);
+		w.problems++;
+		if (repair) {
+			inode->size = inode->size < 0 ? 0 : inode_size_limit(inode);
+			changed = 1;
+		}
+	}
+
+	*problems += w.problems;
+	return changed || w.rewritten;
+}
+
+// compare a bitmap with what the scan found and, when repairing, replace it
+static int fsck_reconcile(struct fs_bitmap *map, const struct fs_bitmap *found, const char *what, int repair)
+{
+	int leaked = 0, missing = 0;
+	int w;
+
+	for (w = 0; w < map->nwords; w++) {
+		leaked += __builtin_popcountll(map->words[w] & ~found->words[w]);
+		missing += __builtin_popcountll(found->words[w] & ~map->words[w]);
+	}
+	if (leaked) {
+		printf("simplefs: %d %s marked in use but not in use.\n", leaked, what);
+	}
+	if (missing) {
+		printf("simplefs: %d %s in use but marked free.\n", missing, what);
+	}
+
+	if (repair && (leaked || missing)) {
+		memcpy(map->words, found->words, map->nwords * sizeof(uint64_t));
+		bitmap_recount(map);
+		if (map->dirty) {
+			memset(map->dirty, 1, map->ndiskblocks);
+		}
+	}
+	return leaked + missing;
+}
+
+// compare the reference counts with the references the scan found and, when repairing, take
+// those. a block more than one inode points to is then shared: writes give each its own copy
+static int fsck_refs(const uint32_t *counts, int repair)
+{
+	uint16_t *refs = (uint16_t *)fs.refs.entries;
+	int wrong = 0;
+	int i;
+
+	for (i = data_start(); i < fs.super.nblocks; i++) {
+		int extra = counts[i] > 1 ? counts[i] - 1 : 0;
+		if (extra > REFS_MAX) {
+			extra = REFS_MAX;
+		}
+		if (refs[i] != extra) {
+			wrong++;
+			if (repair) {
+				fs.nshared += extra - refs[i];
+				refs[i] = extra;
+				table_mark_dirty(&fs.refs, i);
+			}
+		}
+	}
+	if (wrong) {
+		printf("simplefs: %d blocks have the wrong reference count.\n", wrong);
+	}
+	return wrong;
+}
+
+int fs_fsck(int repair)
+{
+	if (!fs.mounted) {
+		printf("simplefs: Error! No mounted disk.\n");
+		return -1;
+	}
+
+	// buffered writes have to be on disk before we can check them
+	writebuf_flush_all();
+
+	// every worker records the blocks and inodes in use in its share of the inode table
+	struct fs_scanjob jobs[SCAN_MAX_THREADS];
+	int ninodeblocks = inode_blocks_initialized(&fs.super);
+	int njobs = scan_threads(ninodeblocks);
+	struct fs_bitmap used, inodes, dup, bad, claimed;
+	uint32_t *counts = NULL;
+	int problems = 0;
+	int ok = 1;
+	int i, w;
+
+	memset(jobs, 0, sizeof(jobs));
+	memset(&claimed, 0, sizeof(claimed));
+	if (fs.refs.entries) {
+		counts = calloc(fs.super.nblocks, sizeof(uint32_t));
+		ok = counts != NULL;
+	}
+	for (i = 0; i < njobs; i++) {
+		ok = ok && bitmap_init(&jobs[i].partbitmap, fs.super.nblocks) && bitmap_init(&jobs[i].partdup, fs.super.nblocks) &&
+		     bitmap_init(&jobs[i].partinodemap, fs.super.ninodes) && bitmap_init(&jobs[i].partbad, fs.super.ninodes);
+		jobs[i].counts = counts;
+	}
+	ok = ok && bitmap_init(&claimed, fs.super.nblocks);
+	if (!ok) {
+		printf("simplefs: Error! Unable to allocate the bitmap.\n");
+		problems = -1;
+		goto out;
+	}
+
+	scan_run(jobs, njobs, ninodeblocks, fsck_worker);
+
+	// fold everything into the first job's maps; a block two workers both saw is a duplicate
+	used = jobs[0].partbitmap;
+	inodes = jobs[0].partinodemap;
+	dup = jobs[0].partdup;
+	bad = jobs[0].partbad;
+	for (i = 1; i < njobs; i++) {
+		for (w = 0; w < used.nwords && !counts; w++) {
+			dup.words[w] |= jobs[i].partdup.words[w] | (used.words[w] & jobs[i].partbitmap.words[w]);
+		}
+		bitmap_merge(&used, &jobs[i].partbitmap);
+		bitmap_merge(&inodes, &jobs[i].partinodemap);
+		bitmap_merge(&bad, &jobs[i].partbad);
+	}
+
+	pthread_mutex_lock(&fs.lock);
+
+	// go through the inodes with problems in order; with duplicates around, all of them,
+	// so that the first inode to use a block keeps it
+	int dups = bitmap_find_set(&dup, 0, dup.nbits) < dup.nbits;
+	int perblock = inodes_per_block(fs.super.version);
+	for (i = 1; i <= inode_blocks_initialized(&fs.super); i++) {
+		int first = getInodeNumber(i, 0, perblock);
+		if (!dups && bitmap_find_set(&bad, first, first + perblock) == first + perblock) {
+			continue;
+		}
+
+		BLOCK_BUFFER(block);
+		struct fs_inode inode;
+		int dirty = 0;
+		int j;
+
+		disk_read(i, block->data);
+		for (j = 0; j < perblock; j++) {
+			int inumber = first + j;
+			inode_load(block, fs.super.version, j, &inode);
+			if (inode.isvalid && (dups || bitmap_test(&bad, inumber)) &&
+			    fsck_inode(&inode, inumber, &dup, &claimed, repair, &problems)) {
+				inode_store(block, fs.super.version, j, &inode);
+				readahead_forget(inumber);
+				blockmap_forget(inumber);
+				dirty = 1;
+			}
+		}
+		if (dirty) {
+			disk_write(i, block->data);
+		}
+	}
+
+	// then the bitmaps: metadata blocks and inode 0 are always in use
+	for (i = 0; i < data_start(); i++) {
+		bitmap_set(&used, i);
+	}
+	bitmap_set(&inodes, 0);
+	problems += fsck_reconcile(&fs.bitmap, &used, "blocks are", repair);
+	problems += fsck_reconcile(&fs.inodemap, &inodes, "inodes are", repair);
+	if (counts) {
+		problems += fsck_refs(counts, repair);
+	}
+
+	if (repair) {
+		blocks_sync();
+		bitmap_sync(&fs.inodemap);
+	}
+	pthread_mutex_unlock(&fs.lock);
+	if (repair) {
+		disk_flush();
+	}
+
+out:
+	for (i = 0; i < njobs; i++) {
+		bitmap_free(&jobs[i].partbitmap);
+		bitmap_free(&jobs[i].partdup);
+		bitmap_free(&jobs[i].partinodemap);
+		bitmap_free(&jobs[i].partbad);
+	}
+	bitmap_free(&claimed);
+	free(counts);
+	return problems;
+}
+
+int fs_create()
+{
+	// no mounted disk
+	if (!fs.mounted) {
+		printf("simplefs: Error! No mounted disk.\n");
+		return 0;
+	}
+
+	BLOCK_BUFFER(block);
+	int inodeNumber, blockNumber, index;
+
+	pthread_mutex_lock(&fs.lock);
+
+	// take a free inode straight from the inode bitmap (inode 0 is reserved)
+	while ((inodeNumber = bitmap_alloc(&fs.inodemap, 1)) >= 0) {
+		inode_locate(inodeNumber, &blockNumber, &index);
+
+		// read in only the inode block that holds it, after clearing it if it is still
+		// as fs_format left it
+		inode_block_init(blockNumber);
+		inode_block_read(blockNumber, block);
+
+		struct fs_inode inode;
+		inode_load(block, fs.super.version, index, &inode);
+
+		// a stale bitmap could hand out a live inode; its bit stays set, try the next one
+		if (inode.isvalid) {
+			continue;
+		}
+
+		// set our new inode (reset all the pointers and set size to 0)
+		memset(&inode, 0, sizeof(inode));
+		inode.isvalid = 1;
+
+		// set the inode at the index in the block to our new inode
+		inode_store(block, fs.super.version, index, &inode);
+		// write updated inode block to disk
+		disk_write(blockNumber, block->data);
+		bitmap_sync(&fs.inodemap);
+		pthread_mutex_unlock(&fs.lock);
+
+		// on success, return the inode number
+		return inodeNumber;
+	}
+	pthread_mutex_unlock(&fs.lock);
+
+	// return 0 on failure to create inode (all inode blocks are full)
+	printf("simplefs: Error! Unable to create new inode.\n");
+	return 0;
+}
+
+// the blocks below a pointer block go with it, once no other file points to it
+static int release_visit(int blocknum, void *arg)
+{
+	int shared = refs_get(blocknum) > 0;
+
+	(void)arg;
+	releaseBlock(blocknum);
+	return !shared;
+}
+
+static int delete_inode(int inumber, int blockNumber, int index)
+{
+	// whatever is still buffered for the inode is simply thrown away
+	writebuf_forget(inumber);
+
+	//read in the data from our inode block
+	BLOCK_BUFFER(block);
+	inode_block_read(blockNumber, block);
+
+	struct fs_inode inode;
+	inode_load(block, fs.super.version, index, &inode);
+	if (inode.isvalid) {
+		// give the data blocks (and the pointer blocks) back to the bitmap, including
+		// any preallocated past the end of the file
+		inode_walk(&inode, release_visit, NULL);
+		blocks_sync();
+
+		//zero out everything in the inode struct.
+		memset(&inode, 0, sizeof(inode));
+		inode_store(block, fs.super.version, index, &inode); //update block's inode.
+		disk_write(blockNumber, block->data);
+
+		// the inode can be handed out again
+		readahead_forget(inumber);
+		blockmap_forget(inumber);
+		bitmap_clear(&fs.inodemap, inumber);
+		bitmap_sync(&fs.inodemap);
+		return 1;
+	}
+
+	// return 0 if it's an invalid inode
+	printf("simplefs: Error! Unable to delete inode.\n");
+	return 0;
+}
+
+int fs_delete(int inumber)
+{
+	if (!fs.mounted) {
+		printf("simplefs: Error! No mounted disk.\n");
+		return 0;
+	}
+
+	// find the block index that we need
+	int blockNumber, index;
+
+	// ensure that the index is not beyond the bounds
+	if (!inode_locate(inumber, &blockNumber, &index))
+	{
+		printf("simplefs: Error! Block number is out of bounds.\n");
+		return 0;
+	}
+
+	pthread_rwlock_wrlock(inode_lock(inumber));
+	pthread_mutex_lock(&fs.lock);
+	int result = delete_inode(inumber, blockNumber, index);
+	pthread_mutex_unlock(&fs.lock);
+	pthread_rwlock_unlock(inode_lock(inumber));
+	return result;
+}
+
+int fs_clone(int inumber)
+{
+	if (!fs.mounted) {
+		printf("simplefs: Error! No mounted disk.\n");
+		return 0;
+	}
+
+	int blockNumber, index;
+	if (!inode_locate(inumber, &blockNumber, &index)) {
+		printf("simplefs: Error! Invalid inumber.\n");
+		return 0;
+	}
+
+	// the files share blocks, which takes the reference counts of a version 5 disk
+	if (fs.refs.entries == NULL) {
+		printf("simplefs: Error! The disk keeps no reference counts; format it again to clone files.\n");
+		return 0;
+	}
+
+	int clone = fs_create();
+	if (clone == 0) {
+		return 0;
+	}
+	int cloneBlock, cloneIndex;
+	inode_locate(clone, &cloneBlock, &cloneIndex);
+
+	// buffered writes are part of what is cloned
+	pthread_rwlock_wrlock(inode_lock(inumber));
+	writebuf_flush_inode(inumber);
+	pthread_mutex_lock(&fs.lock);
+
+	BLOCK_BUFFER(block);
+	struct fs_inode inode;
+	inode_block_read(blockNumber, block);
+	inode_load(block, fs.super.version, index, &inode);
+	if (!inode.isvalid) {
+		printf("simplefs: Error! Invalid inode number.\n");
+		delete_inode(clone, cloneBlock, cloneIndex);
+		pthread_mutex_unlock(&fs.lock);
+		pthread_rwlock_unlock(inode_lock(inumber));
+		return 0;
+	}
+
+	// the clone gets the same pointers (or inline data), and every block the inode points to
+	// directly one more reference. what lies below a pointer block is shared along with it,
+	// and only copied once one of the files writes there, so this takes the same time for
+	// any size of file
+	int *pointers[POINTERS_PER_INODE + 3];
+	int k, n = 0;
+	for (k = 0; k < POINTERS_PER_INODE; k++) {
+		pointers[n++] = &inode.direct[k];
+	}
+	pointers[n++] = &inode.indirect;
+	pointers[n++] = &inode.dindirect;
+	pointers[n++] = &inode.tindirect;
+	for (k = 0; k < n; k++) {
+		if (*pointers[k] && !refs_take(*pointers[k])) {
+			printf("simplefs: Error! Block %d is shared too many times to clone.\n", *pointers[k]);
+			break;
+		}
+	}
+	if (k < n) {
+		while (k-- > 0) {
+			if (*pointers[k]) {
+				refs_drop(*pointers[k]);
+			}
+		}
+		delete_inode(clone, cloneBlock, cloneIndex);
+		pthread_mutex_unlock(&fs.lock);
+		pthread_rwlock_unlock(inode_lock(inumber));
+		return 0;
+	}
+
+	inode_block_read(cloneBlock, block);
+	inode_store(block, fs.super.version, cloneIndex, &inode);
+	disk_write(cloneBlock, block->data);
+	blocks_sync();
+	pthread_mutex_unlock(&fs.lock);
+	pthread_rwlock_unlock(inode_lock(inumber));
+	return clone;
+}
+
+long long fs_getsize(int inumber)
+{
+	if (!fs.mounted) {
+		printf("simplefs: Error! No mounted disk.\n");
+		return -1;
+	}
+
+	// get inode block
+	int blockNumber, index;
+
+	// check if the block number is valid; return -1 on error
+	if (!inode_locate(inumber, &blockNumber, &index))
+	{
+		printf("simplefs: Error! Block number is out of bounds.\n");
+		return -1;
+	}
+
+	// read in the inode block
+	BLOCK_BUFFER(block);
+	pthread_rwlock_rdlock(inode_lock(inumber));
+	inode_block_read(blockNumber, block);
+	const union fs_block *inodes = block;
+
+	// read in the inode
+	struct fs_inode inode;
+	inode_load(inodes, fs.super.version, index, &inode);
+
+	// check if inode is valid; return size on success
+	if (inode.isvalid)
+	{
+		pthread_mutex_lock(&fs.lock);
+		long long size = writebuf_size(inumber, inode.size);
+		pthread_mutex_unlock(&fs.lock);
+		pthread_rwlock_unlock(inode_lock(inumber));
+		return size;
+	}
+	pthread_rwlock_unlock(inode_lock(inumber));
+
+	// inode is invalid; return -1 on error
+	printf("simplefs: Error! Invalid inode number.\n");
+	return -1;
+}
+
+// the part of fs.reserved that the buffer this thread is writing out may still allocate
+static __thread int flushreserve;
+
+// blocks an allocation may take: the free ones, less those promised to buffered writes
+// other than the one this thread is writing out. the caller holds fs.lock
+static int blocks_available()
+{
+	return fs.bitmap.nfree - (fs.reserved - flushreserve);
+}
+
+// n blocks were just allocated: a buffer being written out uses up its promise first
+static void blocks_taken(int n)
+{
+	if (n > flushreserve) {
+		n = flushreserve;
+	}
+	flushreserve -= n;
+	fs.reserved -= n;
+}
+
+int getNextBlock() {
+	// called with fs.lock held; data blocks start right after the inode blocks and the bitmap
+	int i = blocks_available() > 0 ? bitmap_alloc(&fs.bitmap, data_start()) : -1;
+	if (i >= 0) {
+		blocks_taken(1);
+		return i;
+	}
+
+	printf("simplefs: Error! There is no more room for blocks.\n");
+	return -1;
+}
+
+// a fresh pointer block with no pointers in it, or 0 if the disk is full
+static int pointer_block_new()
+{
+	int blocknum = getNextBlock();
+	if (blocknum < 0) {
+		return 0;
+	}
+
+	BLOCK_BUFFER(block);
+	memset(block->data, 0, BLOCK_SIZE);
+	disk_write(blocknum, block->data);
+	hash_forget(blocknum);
+	return blocknum;
+}
+
+// a copy of a pointer block other files share, for one of them to change: what it points
+// to gains a reference and the original loses one. returns 0 if the disk is full
+static int pointer_block_copy(int blocknum)
+{
+	BLOCK_BUFFER(block);
+	int k;
+
+	disk_read(blocknum, block->data);
+	for (k = 0; k < POINTERS_PER_BLOCK; k++) {
+		if (block->pointers[k] && !refs_take(block->pointers[k])) {
+			printf("simplefs: Error! Block %d is shared too many times to copy.\n", block->pointers[k]);
+			break;
+		}
+	}
+	int copy = k == POINTERS_PER_BLOCK ? getNextBlock() : -1;
+	if (copy < 0) {
+		while (k-- > 0) {
+			if (block->pointers[k]) {
+				refs_drop(block->pointers[k]);
+			}
+		}
+		return 0;
+	}
+
+	disk_write(copy, block->data);
+	hash_forget(copy);
+	releaseBlock(blocknum);
+	return copy;
+}
+
+// point *pointer, which refers to a pointer block, at one this file has to itself
+static int pointer_unshare(int *pointer)
+{
+	if (refs_get(*pointer) > 0) {
+		int copy = pointer_block_copy(*pointer);
+		if (copy == 0) {
+			return 0;
+		}
+		*pointer = copy;
+	}
+	return 1;
+}
+
+// the indirect block holding file block n's pointer (n is past the direct blocks), read down
+// from the inode. POINTER_PRIVATE copies shared pointer blocks on the way so the result can
+// be changed, and POINTER_CREATE also creates missing ones. returns 0 if one is missing (never
+// with POINTER_CREATE), or -1 if the disk is full.
+static int pointer_block_for(struct fs_inode *inode, int n, int mode)
+{
+	int rel;
+	int level = file_block_level(n, &rel);
+	int *root = level == 1 ? &inode->indirect : level == 2 ? &inode->dindirect : &inode->tindirect;
+
+	if (*root == 0) {
+		if (mode != POINTER_CREATE) {
+			return 0;
+		}
+		if ((*root = pointer_block_new()) == 0) {
+			return -1;
+		}
+	}
+	else if (mode != POINTER_FIND && !pointer_unshare(root)) {
+		return -1;
+	}
+
+	int blocknum = *root;
+	int l;
+	for (l = level; l > 1; l--) {
+		BLOCK_BUFFER(block);
+		int k = (rel / level_span(l)) % POINTERS_PER_BLOCK;
+
+		disk_read(blocknum, block->data);
+		if (block->pointers[k] == 0) {
+			if (mode != POINTER_CREATE) {
+				return 0;
+			}
+			if ((block->pointers[k] = pointer_block_new()) == 0) {
+				return -1;
+			}
+			disk_write(blocknum, block->data);
+		}
+		else if (mode != POINTER_FIND && refs_get(block->pointers[k]) > 0) {
+			if (!pointer_unshare(&block->pointers[k])) {
+				return -1;
+			}
+			disk_write(blocknum, block->data);
+		}
+		blocknum = block->pointers[k];
+	}
+	return blocknum;
+}
+
+// make the pointer blocks above file blocks [first, first+count) the inode's own, so that the
+// counts of the blocks below them tell whether another file shares those. returns 0 if the disk
+// is full. the caller holds fs.lock and stores the inode afterwards
+static int inode_unshare(struct fs_inode *inode, int first, int count)
+{
+	int n = first < POINTERS_PER_INODE ? POINTERS_PER_INODE : first;
+
+	// only a disk where something is shared has anything to copy
+	if (fs.nshared == 0) {
+		return 1;
+	}
+	while (n < first + count) {
+		int rel;
+		file_block_level(n, &rel);
+		if (pointer_block_for(inode, n, POINTER_PRIVATE) < 0) {
+			return 0;
+		}
+		n += POINTERS_PER_BLOCK - rel % POINTERS_PER_BLOCK;
+	}
+	return 1;
+}
+
+// does file block n start a new indirect block?
+static int pointer_block_start(int n)
+{
+	return n >= POINTERS_PER_INODE && (n - POINTERS_PER_INODE) % POINTERS_PER_BLOCK == 0;
+}
+
+// how many pointer blocks inode_alloc_blocks would have to create for file blocks [first, first+count)
+static int pointer_blocks_missing(const struct fs_inode *inode, int first, int count)
+{
+	int missing = 0;
+	int prevlevel = 0;
+	int n = first < POINTERS_PER_INODE ? POINTERS_PER_INODE : first;
+
+	while (n < first + count) {
+		int rel;
+		int level = file_block_level(n, &rel);
+		int blocknum = inode_root(inode, level);
+		int l;
+
+		// a missing pointer block is counted for the first indirect block of the range
+		// below it only
+		for (l = level; l >= 1; l--) {
+			if (blocknum == 0) {
+				if (level != prevlevel || rel % level_span(l + 1) == 0) {
+					missing++;
+				}
+			}
+			else if (l > 1) {
+				BLOCK_BUFFER(scratch);
+				const union fs_block *block = block_view(blocknum, scratch);
+				blocknum = block->pointers[(rel / level_span(l)) % POINTERS_PER_BLOCK];
+			}
+		}
+
+		prevlevel = level;
+		n += POINTERS_PER_BLOCK - rel % POINTERS_PER_BLOCK;
+	}
+	return missing;
+}
+
+// does inode_alloc_blocks have to find a new block for entry i?
+static int alloc_wanted(const int *old, const int *change, int i)
+{
+	if (change && change[i]) {
+		return change[i] < 0;
+	}
+	return old[i] == 0;
+}
+
+// like inode_map_blocks, but allocate what is missing; returns how many blocks could be mapped.
+// old[] is the current mapping (-1 for a missing block to leave as a hole); each stretch of
+// missing blocks is given one contiguous run of disk blocks where the bitmap has one.
+// change[] may be NULL. change[i] > 0 makes file block i share that block in use instead, a
+// reference the caller has already taken, and change[i] < 0 gives it a new block in place of
+// one it shares with other files.
+static int inode_alloc_blocks(struct fs_inode *inode, int first, int count, const int *old, const int *change, int *blocks)
+{
+	BLOCK_BUFFER(leaf);
+	int leafnum = 0, leafdirty = 0;
+	int runstart = 0, runleft = 0;
+	int i;
+
+	// claim the pointer blocks before any data run, so a run cannot take the last free block
+	for (i = 0; i < count; i++) {
+		int n = first + i;
+		if (n >= POINTERS_PER_INODE && (i == 0 || pointer_block_start(n)) && pointer_block_for(inode, n, POINTER_CREATE) <= 0) {
+			printf("simplefs: Error! There is no space left to write to.\n");
+			count = i;
+			break;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		int n = first + i;
+		int *pointer;
+
+		if (n < POINTERS_PER_INODE) {
+			pointer = &inode->direct[n];
+		}
+		else {
+			// move on to the next indirect block, writing back the one we are done with
+			if (leafnum == 0 || pointer_block_start(n)) {
+				if (leafdirty) {
+					disk_write(leafnum, leaf->data);
+				}
+				leafnum = pointer_block_for(inode, n, POINTER_FIND);
+				disk_read(leafnum, leaf->data);
+				leafdirty = 0;
+			}
+			int rel;
+			file_block_level(n, &rel);
+			pointer = &leaf->pointers[rel % POINTERS_PER_BLOCK];
+		}
+
+		if (change && change[i] > 0) {
+			if (*pointer != change[i]) {
+				if (*pointer) {
+					releaseBlock(*pointer);
+				}
+				*pointer = change[i];
+				if (n >= POINTERS_PER_INODE) {
+					leafdirty = 1;
+				}
+			}
+			blocks[i] = *pointer;
+			continue;
+		}
+		if (change && change[i] < 0 && *pointer) {
+			releaseBlock(*pointer);
+			*pointer = 0;
+			if (n >= POINTERS_PER_INODE) {
+				leafdirty = 1;
+			}
+		}
+
+		if (*pointer == 0 && old[i] >= 0) {
+			if (runleft == 0) {
+				int want = 1;
+				while (i + want < count && alloc_wanted(old, change, i + want)) {
+					want++;
+				}
+				if (want > blocks_available()) {
+					want = blocks_available();
+				}
+				runleft = bitmap_alloc_run(&fs.bitmap, data_start(), want, &runstart);
+				blocks_taken(runleft);
+				if (runleft == 0) {
+					printf("simplefs: Error! Not enough space left to write to.\n");
+					break;
+				}
+			}
+			*pointer = runstart++;
+			runleft--;
+			if (n >= POINTERS_PER_INODE) {
+				leafdirty = 1;
+			}
+		}
+		blocks[i] = *pointer;
+	}
+
+	if (leafdirty) {
+		disk_write(leafnum, leaf->data);
+	}
+
+	// hand back whatever part of the last run went unused
+	while (runleft > 0) {
+		bitmap_clear(&fs.bitmap, runstart++);
+		runleft--;
+	}
+
+	return i;
+}
+
+// give back the data blocks behind count file blocks from first, leaving holes. the caller
+// holds fs.lock, and has made the pointer blocks above them the inode's own (inode_unshare).
+static void inode_free_blocks(struct fs_inode *inode, int first, int count)
+{
+	BLOCK_BUFFER(leaf);
+	int leafnum = 0, leafdirty = 0;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		int n = first + i;
+		int *pointer;
+
+		if (n < POINTERS_PER_INODE) {
+			pointer = &inode->direct[n];
+		}
+		else {
+			if (leafnum == 0 || pointer_block_start(n)) {
+				if (leafdirty) {
+					disk_write(leafnum, leaf->data);
+				}
+				leafdirty = 0;
+				leafnum = pointer_block_for(inode, n, POINTER_FIND);
+				if (leafnum == 0) {
+					continue;
+				}
+				disk_read(leafnum, leaf->data);
+			}
+			int rel;
+			file_block_level(n, &rel);
+			pointer = &leaf->pointers[rel % POINTERS_PER_BLOCK];
+		}
+
+		if (*pointer) {
+			releaseBlock(*pointer);
+			*pointer = 0;
+			if (n >= POINTERS_PER_INODE) {
+				leafdirty = 1;
+			}
+		}
+	}
+
+	if (leafdirty) {
+		disk_write(leafnum, leaf->data);
+	}
+}
+
+// whether length bytes of data are all zero
+static int is_zero(const char *data, int length)
+{
+	return data[0] == 0 && memcmp(data, data + 1, length - 1) == 0;
+}
+
+// bytes past the end of a file read back as zeros, but a preallocated block there still holds
+// whatever was on disk before. clear that part of buf, which holds file block n.
+static void clear_past_eof(char *buf, int n, long long size)
+{
+	long long start = (long long)n * BLOCK_SIZE;
+
+	if (start >= size) {
+		memset(buf, 0, BLOCK_SIZE);
+	}
+	else if (start + BLOCK_SIZE > size) {
+		memset(&buf[size - start], 0, start + BLOCK_SIZE - size);
+	}
+}
+
+// queue the transfer of count file blocks between disk blocks[] and memory bufs[],
+// merging neighbours that are contiguous both on disk and in memory into one request.
+// reading an unallocated block (0) just zero-fills its buffer; a negative entry is skipped.
+static void submit_blocks(const int *blocks, char **bufs, int count, int write)
+{
+	int i = 0;
+
+	while (i < count) {
+		int run = 1;
+
+		if (blocks[i] < 0) {
+			i++;
+			continue;
+		}
+		if (blocks[i] == 0) {
+			if (!write) {
+				memset(bufs[i], 0, BLOCK_SIZE);
+			}
+			i++;
+			continue;
+		}
+
+		while (i + run < count && blocks[i + run] == blocks[i] + run && bufs[i + run] == bufs[i] + run * BLOCK_SIZE) {
+			run++;
+		}
+
+		if (write) {
+			disk_submit_write(blocks[i], run, bufs[i]);
+		}
+		else {
+			disk_submit_read(blocks[i], run, bufs[i]);
+		}
+		i += run;
+	}
+}
+
+/*
+On a compressed filesystem file data is kept in clusters of COMPRESS_CLUSTER blocks, each
+written whole. A cluster is compressed into as few blocks as it fits in, after a header
+with the compressed length, or stored as it is when that would not save a block. The
+pointers tell the kinds apart: a plain cluster uses all of its pointers, a compressed one
+only the first few, and a hole none of them.
+*/
+
+// how many of a cluster's pointers are in use
+static int cluster_blocks(const int *pointers)
+{
+	int k = 0;
+
+	if (pointers[COMPRESS_CLUSTER - 1]) {
+		return COMPRESS_CLUSTER;
+	}
+	while (k < COMPRESS_CLUSTER && pointers[k]) {
+		k++;
+	}
+	return k;
+}
+
+static void cluster_clear_past_eof(char *buf, int c, long long size)
+{
+	int i;
+
+	for (i = 0; i < COMPRESS_CLUSTER; i++) {
+		clear_past_eof(&buf[i * BLOCK_SIZE], c * COMPRESS_CLUSTER + i, size);
+	}
+}
+
+// read count (at most CLUSTER_BATCH) clusters from cluster first on into buf. the caller
+// holds the inode locked, but not fs.lock. returns 0 if a compressed cluster is damaged.
+static int clusters_load(int inumber, const struct fs_inode *inode, int first, int count, char *buf)
+{
+	int blocks[CLUSTER_BATCH * COMPRESS_CLUSTER];
+	char *bufs[CLUSTER_BATCH * COMPRESS_CLUSTER];
+	int used[CLUSTER_BATCH];
+	char *packed = NULL;
+	int c, i, ok = 1;
+
+	pthread_mutex_lock(&fs.lock);
+	blockmap_lookup(inumber, inode, first * COMPRESS_CLUSTER, count * COMPRESS_CLUSTER, blocks);
+	pthread_mutex_unlock(&fs.lock);
+
+	// plain clusters are read straight into buf, compressed ones next to it
+	for (c = 0; c < count; c++) {
+		int *pointers = &blocks[c * COMPRESS_CLUSTER];
+		char *data = &buf[(size_t)c * CLUSTER_SIZE];
+
+		used[c] = cluster_blocks(pointers);
+		if (used[c] > 0 && used[c] < COMPRESS_CLUSTER && packed == NULL) {
+			packed = malloc((size_t)count * CLUSTER_SIZE);
+			if (packed == NULL) {
+				printf("simplefs: Error! Out of memory.\n");
+				return 0;
+			}
+		}
+		if (used[c] == 0) {
+			memset(data, 0, CLUSTER_SIZE);
+		}
+		for (i = 0; i < COMPRESS_CLUSTER; i++) {
+			if (used[c] == COMPRESS_CLUSTER) {
+				bufs[c * COMPRESS_CLUSTER + i] = &data[i * BLOCK_SIZE];
+			}
+			else if (i < used[c]) {
+				bufs[c * COMPRESS_CLUSTER + i] = &packed[(size_t)c * CLUSTER_SIZE + i * BLOCK_SIZE];
+			}
+			else {
+				pointers[i] = -1;
+			}
+		}
+	}
+	submit_blocks(blocks, bufs, count * COMPRESS_CLUSTER, 0);
+	disk_wait();
+
+	for (c = 0; c < count; c++) {
+		if (used[c] == 0 || used[c] == COMPRESS_CLUSTER) {
+			continue;
+		}
+
+		const char *in = &packed[(size_t)c * CLUSTER_SIZE];
+		char *data = &buf[(size_t)c * CLUSTER_SIZE];
+		int length;
+		memcpy(&length, in, sizeof(length));
+		if (length <= 0 || length > used[c] * BLOCK_SIZE - CLUSTER_HEADER ||
+		    lz_decompress(&in[CLUSTER_HEADER], length, data, CLUSTER_SIZE) != CLUSTER_SIZE) {
+			printf("simplefs: Error! Cluster %d of inode %d is damaged.\n", first + c, inumber);
+			memset(data, 0, CLUSTER_SIZE);
+			ok = 0;
+		}
+	}
+
+	free(packed);
+	return ok;
+}
+
+// write cluster c as data (CLUSTER_SIZE bytes) now reads, compressing it into packed (as big)
+// if that saves a block. its blocks are reused, allocated or freed to match and the writes
+// queued; the caller waits for them. the caller holds the inode locked for writing, but not
+// fs.lock. returns 0 if the disk is full.
+static int cluster_store(int inumber, struct fs_inode *inode, int c, const char *data, char *packed)
+{
+	int old[COMPRESS_CLUSTER], blocks[COMPRESS_CLUSTER], change[COMPRESS_CLUSTER];
+	char *bufs[COMPRESS_CLUSTER];
+	const char *from = data;
+	int first = c * COMPRESS_CLUSTER;
+	int used, i;
+
+	// a cluster of zeros becomes a hole
+	if (is_zero(data, CLUSTER_SIZE)) {
+		used = 0;
+	}
+	else {
+		int length = lz_compress(data, CLUSTER_SIZE, &packed[CLUSTER_HEADER], (COMPRESS_CLUSTER - 1) * BLOCK_SIZE - CLUSTER_HEADER);
+		if (length > 0) {
+			used = (CLUSTER_HEADER + length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+			memcpy(packed, &length, sizeof(length));
+			memset(&packed[CLUSTER_HEADER + length], 0, used * BLOCK_SIZE - CLUSTER_HEADER - length);
+			from = packed;
+		}
+		else {
+			used = COMPRESS_CLUSTER;
+		}
+	}
+
+	pthread_mutex_lock(&fs.lock);
+	if (!inode_unshare(inode, first, COMPRESS_CLUSTER)) {
+		pthread_mutex_unlock(&fs.lock);
+		return 0;
+	}
+	blockmap_lookup(inumber, inode, first, COMPRESS_CLUSTER, old);
+	for (i = used; i < COMPRESS_CLUSTER; i++) {
+		if (old[i]) {
+			inode_free_blocks(inode, first + used, COMPRESS_CLUSTER - used);
+			break;
+		}
+	}
+
+	// a cluster left half allocated would read as a compressed one, so check for room first.
+	// a block another file shares is not written over, but replaced
+	int missing = pointer_blocks_missing(inode, first, used);
+	for (i = 0; i < used; i++) {
+		change[i] = old[i] && refs_get(old[i]) > 0 ? -1 : 0;
+		if (old[i] == 0 || change[i]) {
+			missing++;
+		}
+	}
+	if (missing > blocks_available()) {
+		pthread_mutex_unlock(&fs.lock);
+		printf("simplefs: Error! Not enough space left to write to.\n");
+		return 0;
+	}
+
+	memset(blocks, 0, sizeof(blocks));
+	if (used > 0) {
+		inode_alloc_blocks(inode, first, used, old, change, blocks);
+	}
+	blockmap_update(inumber, first, COMPRESS_CLUSTER, blocks);
+	if (used == COMPRESS_CLUSTER) {
+		fs.nrawclusters++;
+	}
+	else if (used > 0) {
+		fs.nclusters++;
+		fs.nclusterblocks += used;
+	}
+	pthread_mutex_unlock(&fs.lock);
+
+	for (i = 0; i < used; i++) {
+		bufs[i] = (char *)&from[i * BLOCK_SIZE];
+	}
+	submit_blocks(blocks, bufs, used, 1);
+	return 1;
+}
+
+// fs_read on a compressed filesystem, once the range is known to be inside the file
+static int read_clusters(int inumber, const struct fs_inode *inode, char *data, int length, long long offset)
+{
+	char *buf = malloc((size_t)CLUSTER_BATCH * CLUSTER_SIZE);
+	long long pos = offset, end = offset + length;
+
+	if (buf == NULL) {
+		printf("simplefs: Error! Out of memory.\n");
+		return -1;
+	}
+
+	while (pos < end) {
+		int c = pos / CLUSTER_SIZE;
+		int count = (end - 1) / CLUSTER_SIZE - c + 1;
+		if (count > CLUSTER_BATCH) {
+			count = CLUSTER_BATCH;
+		}
+		if (!clusters_load(inumber, inode, c, count, buf)) {
+			free(buf);
+			return -1;
+		}
+
+		long long from = pos - (long long)c * CLUSTER_SIZE;
+		long long n = (long long)count * CLUSTER_SIZE - from;
+		if (n > end - pos) {
+			n = end - pos;
+		}
+		memcpy(&data[pos - offset], &buf[from], n);
+		pos += n;
+	}
+
+	free(buf);
+	return length;
+}
+
+// fs_write on a compressed filesystem: every cluster the write touches is written whole.
+// the caller holds the inode locked for writing and stores it afterwards. returns the
+// bytes written, or -1.
+static int write_clusters(int inumber, struct fs_inode *inode, const char *data, int length, long long offset)
+{
+	char *work = malloc((size_t)2 * CLUSTER_BATCH * CLUSTER_SIZE);
+	long long end = offset + length, done = offset;
+	int ok = 1;
+	int c, i;
+
+	if (work == NULL) {
+		printf("simplefs: Error! Out of memory.\n");
+		return -1;
+	}
+	char *merged = work;
+	char *packed = &work[(size_t)CLUSTER_BATCH * CLUSTER_SIZE];
+
+	// clusters between the old end of the file and the write that hold blocks (preallocated,
+	// or the one the file ended in) must read back as zeros from now on. nothing is allocated
+	// past the inode's span, and the pointers are looked up a chunk at a time
+	if (offset > inode->size) {
+		int gapend = offset / CLUSTER_SIZE;
+		int spanend = (inode_span(inode) + COMPRESS_CLUSTER - 1) / COMPRESS_CLUSTER;
+		if (gapend > spanend) {
+			gapend = spanend;
+		}
+
+		c = inode->size / CLUSTER_SIZE;
+		while (ok && c < gapend) {
+			int pointers[CLUSTER_BATCH * COMPRESS_CLUSTER * 16];
+			int count = gapend - c < CLUSTER_BATCH * 16 ? gapend - c : CLUSTER_BATCH * 16;
+
+			pthread_mutex_lock(&fs.lock);
+			blockmap_lookup(inumber, inode, c * COMPRESS_CLUSTER, count * COMPRESS_CLUSTER, pointers);
+			pthread_mutex_unlock(&fs.lock);
+			for (i = 0; ok && i < count; i++) {
+				if (cluster_blocks(&pointers[i * COMPRESS_CLUSTER]) == 0) {
+					continue;
+				}
+				ok = clusters_load(inumber, inode, c + i, 1, merged);
+				if (ok) {
+					cluster_clear_past_eof(merged, c + i, inode->size);
+					ok = cluster_store(inumber, inode, c + i, merged, packed);
+					disk_wait();
+				}
+			}
+			c += count;
+		}
+	}
+
+	int first = offset / CLUSTER_SIZE;
+	int last = (end - 1) / CLUSTER_SIZE;
+	for (c = first; ok && c <= last; c += CLUSTER_BATCH) {
+		for (i = 0; ok && i < CLUSTER_BATCH && c + i <= last; i++) {
+			long long start = (long long)(c + i) * CLUSTER_SIZE;
+			const char *from;
+
+			if (start >= offset && start + CLUSTER_SIZE <= end) {
+				from = &data[start - offset];
+			}
+			else {
+				// a cluster the write covers only part of is merged with what it holds now
+				char *buf = &merged[(size_t)i * CLUSTER_SIZE];
+				long long lo = start > offset ? start : offset;
+				long long hi = start + CLUSTER_SIZE < end ? start + CLUSTER_SIZE : end;
+
+				ok = clusters_load(inumber, inode, c + i, 1, buf);
+				if (!ok) {
+					break;
+				}
+				cluster_clear_past_eof(buf, c + i, inode->size);
+				memcpy(&buf[lo - start], &data[lo - offset], hi - lo);
+				from = buf;
+			}
+
+			ok = cluster_store(inumber, inode, c + i, from, &packed[(size_t)i * CLUSTER_SIZE]);
+			if (ok) {
+				done = start + CLUSTER_SIZE < end ? start + CLUSTER_SIZE : end;
+			}
+		}
+		disk_wait();
+	}
+
+	free(work);
+	return done > offset ? done - offset : -1;
+}
+
+// fs_read with the inode locked for reading
+static int read_inode( int inumber, char *data, int length, long long offset )
+{
+	// get inode block
+	int blockNumber, index;
+
+	// check if the block number is valid; return -1 on error
+	if (!inode_locate(inumber, &blockNumber, &index))
+	{
+		printf("simplefs: Error! Block number is out of bounds.\n");
+		return -1;
+	}
+
+	// read in the data from the inode block
+	BLOCK_BUFFER(block);
+	// a copy, not a view of a mapped image: other threads rewrite this block under us
+	inode_block_read(blockNumber, block);
+	const union fs_block *inodes = block;
+
+	// read in the inode we want
+	struct fs_inode inode;
+	inode_load(inodes, fs.super.version, index, &inode);
+
+	// return error if inode is invalid
+	if (!inode.isvalid)
+	{
+		printf("simplefs: Error! Invalid inode.\n");
+		return 0;
+	}
+	// return error if inode's size is 0
+	else if (inode.size == 0)
+	{
+		printf("simplefs: Error! Inode's size is 0.\n");
+		return 0;
+	}
+	// return error if offset is out of bounds
+	else if (offset < 0 || inode.size < offset)
+	{
+		printf("simplefs: Error! Offset is out of bounds.\n");
+		return 0;
+	}
+
+	// adjust length if the end of the inode is reached before that amount of bytes are read
+	if (inode.size < length + offset)
+	{
+		length = inode.size - offset;
+	}
+	if (length <= 0)
+	{
+		return 0;
+	}
+
+	// a small file's data came in with the inode
+	if (inode.flags & INODE_INLINE)
+	{
+		if (offset + length > INODE_INLINE_MAX)
+		{
+			length = offset < INODE_INLINE_MAX ? INODE_INLINE_MAX - offset : 0;
+		}
+		memcpy(data, &inode.data[offset], length);
+		return length;
+	}
+
+	if (fs.super.compress)
+	{
+		return read_clusters(inumber, &inode, data, length, offset);
+	}
+
+	// look up every block the read touches
+	int skip = offset % BLOCK_SIZE;
+	int first = offset / BLOCK_SIZE;
+	int nblocks = (skip + length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	int *blocks = malloc(nblocks * sizeof(int));
+	char **bufs = malloc(nblocks * sizeof(char *));
+	if (blocks == NULL || bufs == NULL)
+	{
+		printf("simplefs: Error! Out of memory.\n");
+		free(blocks);
+		free(bufs);
+		return -1;
+	}
+	pthread_mutex_lock(&fs.lock);
+	blockmap_lookup(inumber, &inode, first, nblocks, blocks);
+	struct fs_readahead *ra = readahead_lookup(inumber);
+	pthread_mutex_unlock(&fs.lock);
+
+	// whole blocks land straight in the caller's buffer; only a partial first or last block is bounced
+	BLOCK_BUFFER(head);
+	BLOCK_BUFFER(tail);
+	int end = (skip + length) % BLOCK_SIZE;
+	int headpartial = skip != 0 || (nblocks == 1 && end != 0);
+	int tailpartial = nblocks > 1 && end != 0;
+
+	int i;
+	for (i = headpartial ? 1 : 0; i < nblocks; i++)
+	{
+		bufs[i] = data + (i * BLOCK_SIZE - skip);
+	}
+	if (headpartial)
+	{
+		bufs[0] = head->data;
+	}
+	if (tailpartial)
+	{
+		bufs[nblocks - 1] = tail->data;
+	}
+
+	// blocks fetched ahead by an earlier call are copied out of memory instead of read again
+	if (ra)
+	{
+		for (i = 0; i < nblocks; i++)
+		{
+			int n = first + i - ra->first;
+			if (n >= 0 && n < ra->count)
+			{
+				memcpy(bufs[i], &ra->data[n * BLOCK_SIZE], BLOCK_SIZE);
+				blocks[i] = -1;
+			}
+		}
+	}
+
+	// queue one request per run of neighbouring blocks that still has to come from disk
+	submit_blocks(blocks, bufs, nblocks, 0);
+
+	// a sequential reader that has used up what was fetched ahead gets the next window,
+	// queued together with its own blocks
+	char **abufs = NULL;
+	if (ra && offset == ra->nextoffset && first + nblocks >= ra->first + ra->count)
+	{
+		int afirst = first + nblocks;
+		int acount = ra->window ? ra->window * 2 : READAHEAD_MIN_WINDOW;
+		if (acount > READAHEAD_MAX_WINDOW)
+		{
+			acount = READAHEAD_MAX_WINDOW;
+		}
+		ra->window = acount;
+		if (afirst + acount > size_to_blocks(inode.size))
+		{
+			acount = size_to_blocks(inode.size) - afirst;
+		}
+
+		ra->count = 0;
+		// one allocation for the buffers and the block numbers, the pointers first to keep them aligned
+		if (acount > 0)
+		{
+			abufs = malloc(acount * (sizeof(char *) + sizeof(int)));
+		}
+		if (abufs)
+		{
+			int *ahead = (int *)&abufs[acount];
+			pthread_mutex_lock(&fs.lock);
+			blockmap_lookup(inumber, &inode, afirst, acount, ahead);
+			pthread_mutex_unlock(&fs.lock);
+			for (i = 0; i < acount; i++)
+			{
+				abufs[i] = &ra->data[i * BLOCK_SIZE];
+			}
+			submit_blocks(ahead, abufs, acount, 0);
+			ra->first = afirst;
+			ra->count = acount;
+		}
+	}
+	else if (ra && offset != ra->nextoffset)
+	{
+		// random access: start over with the smallest window if it turns sequential again
+		ra->window = 0;
+	}
+	if (ra)
+	{
+		ra->nextoffset = offset + length;
+	}
+
+	disk_wait();
+	free(abufs);
+	if (ra)
+	{
+		pthread_mutex_unlock(&ra->busy);
+	}
+
+	if (headpartial)
+	{
+		int n = BLOCK_SIZE - skip;
+		if (n > length)
 		{
-			disk_read(indirectblock.pointers[i], tempblock.data);
+			n = length;
+		}
+		memcpy(data, &head->data[skip], n);
+	}
+	if (tailpartial)
+	{
+		memcpy(&data[length - end], tail->data, end);
+	}
+
+	free(blocks);
+	free(bufs);
+
+	// return the total number of bytes read (could be smaller than the number requested)
+	return length;
+}
+
+int fs_read( int inumber, char *data, int length, long long offset )
+{
+	if (!fs.mounted) {
+		printf("simplefs: Error! No mounted disk.\n");
+		return -1;
+	}
+
+	int blockNumber, index;
+	if (!inode_locate(inumber, &blockNumber, &index))
+	{
+		printf("simplefs: Error! Block number is out of bounds.\n");
+		return -1;
+	}
+
+	// reads see buffered writes by putting them on disk first
+	if (writebuf_pending(inumber))
+	{
+		pthread_rwlock_wrlock(inode_lock(inumber));
+		writebuf_flush_inode(inumber);
+		pthread_rwlock_unlock(inode_lock(inumber));
+	}
 
-			// adjust tempbytesread variable if we have reached the end of the inode
-			if (tempbytesread + totalbytesread > length)
-			{
-				tempbytesread = length - totalbytesread;
-			}
+	pthread_rwlock_rdlock(inode_lock(inumber));
+	int result = read_inode(inumber, data, length, offset);
+	pthread_rwlock_unlock(inode_lock(inumber));
+	return result;
+}
+
+// move an inline file's data out to a block of its own, so that it can grow past the inode.
+// the caller holds the inode locked for writing, but not fs.lock.
+static int inode_uninline(int inumber, int blockNumber, int index, struct fs_inode *inode)
+{
+	BLOCK_BUFFER(block);
+	BLOCK_BUFFER(data);
+	int old = 0, blocknum = 0;
+	int ok = 1;
+
+	memset(data->data, 0, BLOCK_SIZE);
+	memcpy(data->data, inode->data, inode->size < INODE_INLINE_MAX ? inode->size : INODE_INLINE_MAX);
+	memset(inode->data, 0, sizeof(inode->data));
+	inode->flags &= ~INODE_INLINE;
 
-			// append read data to our data variable
-			strncat(data, tempblock.data, tempbytesread);
-			totalbytesread += tempbytesread;
+	// on a compressed filesystem the data becomes the first cluster
+	if (fs.super.compress && inode->size > 0) {
+		char *work = calloc(2, CLUSTER_SIZE);
+		if (work == NULL) {
+			printf("simplefs: Error! Out of memory.\n");
+			return 0;
 		}
+		memcpy(work, data->data, BLOCK_SIZE);
+		ok = cluster_store(inumber, inode, 0, work, &work[CLUSTER_SIZE]);
+		disk_wait();
+		free(work);
+		if (!ok) {
+			return 0;
+		}
+		pthread_mutex_lock(&fs.lock);
+		inode_block_read(blockNumber, block);
+		inode_store(block, fs.super.version, index, inode);
+		disk_write(blockNumber, block->data);
+		blocks_sync();
+		pthread_mutex_unlock(&fs.lock);
+		return 1;
 	}
 
-	// return the total number of bytes read (could be smaller than the number requested)
-	return totalbytesread;
+	pthread_mutex_lock(&fs.lock);
+	if (inode->size > 0) {
+		ok = inode_alloc_blocks(inode, 0, 1, &old, NULL, &blocknum) == 1;
+	}
+	if (ok) {
+		if (blocknum) {
+			disk_write(blocknum, data->data);
+			blockmap_update(inumber, 0, 1, &blocknum);
+		}
+		inode_block_read(blockNumber, block);
+		inode_store(block, fs.super.version, index, inode);
+		disk_write(blockNumber, block->data);
+		blocks_sync();
+	}
+	pthread_mutex_unlock(&fs.lock);
+	return ok;
 }
 
-int getNextBlock() {
-	union fs_block block;
-	disk_read(0, block.data); //read superblock
+// a block in use that holds exactly data, found by its hash, and can be pointed to once more
+// (or is current, the block being overwritten); 0 if there is none. the caller holds fs.lock
+static int dedup_copy(uint64_t hash, int current, const char *data)
+{
+	BLOCK_BUFFER(block);
+	int blocknum = dedup_find(hash);
 
-	int i;
-	for (i = block.super.ninodeblocks + 1; i < sizeBitmap; i++) {
-		if (bitmap[i] == 0) {
-			memset(&bitmap[i], 0, sizeof(bitmap[0]));
-			return i;
+	if (blocknum == 0 || !bitmap_test(&fs.bitmap, blocknum) || (blocknum != current && refs_get(blocknum) >= REFS_MAX)) {
+		return 0;
+	}
+	disk_read(blocknum, block->data);
+	return memcmp(block->data, data, BLOCK_SIZE) == 0 ? blocknum : 0;
+}
+
+// before a write past the end clears the gap [from, to) in place, give the file its own copy of
+// each block there it shares. only the block holding the old end has data to keep; a shared one
+// wholly past the end is just let go and left a hole. returns 0 if the disk is full. the caller
+// holds fs.lock and stores the inode afterwards
+static int gap_unshare(int inumber, struct fs_inode *inode, int from, int to)
+{
+	if (fs.nshared == 0 || from >= to) {
+		return 1;
+	}
+	if (!inode_unshare(inode, from, to - from)) {
+		return 0;
+	}
+
+	int *blocks = malloc(3 * POINTERS_PER_BLOCK * sizeof(int));
+	char *copy = malloc(BLOCK_SIZE);
+	if (blocks == NULL || copy == NULL) {
+		free(blocks);
+		free(copy);
+		return 0;
+	}
+	int *old = &blocks[POINTERS_PER_BLOCK];
+	int *change = &blocks[2 * POINTERS_PER_BLOCK];
+	int ok = 1;
+
+	// an indirect block at a time, so a missing one is never made just to find nothing in it
+	while (ok && from < to) {
+		int count = from < POINTERS_PER_INODE ? POINTERS_PER_INODE - from : POINTERS_PER_BLOCK - (from - POINTERS_PER_INODE) % POINTERS_PER_BLOCK;
+		int keep = -1, shared = 0;
+		int i;
+
+		if (count > to - from) {
+			count = to - from;
 		}
+		blockmap_lookup(inumber, inode, from, count, old);
+		for (i = 0; i < count; i++) {
+			change[i] = 0;
+			if (old[i] > 0 && refs_get(old[i]) > 0) {
+				change[i] = -1;
+				shared = 1;
+				if ((long long)(from + i) * BLOCK_SIZE < inode->size) {
+					keep = i;
+					continue;
+				}
+			}
+			if (old[i] == 0 || change[i] < 0) {
+				old[i] = -1;
+			}
+		}
+
+		// the block with data to keep is let go before its copy is found, so find room first
+		if (keep >= 0 && blocks_available() <= 0) {
+			printf("simplefs: Error! Not enough space left to write to.\n");
+			ok = 0;
+			break;
+		}
+		if (shared) {
+			ok = inode_alloc_blocks(inode, from, count, old, change, blocks) == count;
+			if (!ok) {
+				blockmap_forget(inumber);
+				break;
+			}
+			if (keep >= 0) {
+				disk_read(old[keep], copy);
+				disk_write(blocks[keep], copy);
+			}
+			blockmap_update(inumber, from, count, blocks);
+		}
+		from += count;
 	}
 
-	printf("simplefs: Error! There is no more room for blocks.\n");
-	return -1;
+	free(blocks);
+	free(copy);
+	return ok;
 }
 
-int fs_write( int inumber, const char *data, int length, int offset )
+// write straight through to disk: allocate, transfer and update the inode.
+// the caller holds the inode locked for writing.
+static int write_through( int inumber, const char *data, int length, long long offset )
 {
-	union fs_block block;
-	disk_read(0, block.data);
-	if (inumber == 0 || inumber > block.super.ninodes) {
+	int blockNumber, inodeIndex;
+	if (!inode_locate(inumber, &blockNumber, &inodeIndex)) {
 		printf("simplefs: Error! Invalid inumber.\n");
 		return 0;
 	}
 
+	BLOCK_BUFFER(block);
 	int bytes_written = 0;
-	int blockNumber = getBlockNumber(inumber);
 
 	// we need to read the block to be written to
-	disk_read(blockNumber, block.data);
+	inode_block_read(blockNumber, block);
 
 	// fetch the inode data
-	struct fs_inode inode = block.inode[inumber % 128];
+	struct fs_inode inode;
+	inode_load(block, fs.super.version, inodeIndex, &inode);
 	if (!inode.isvalid) {
 		printf("Error: invalid inode!\n");
 	}
 	else {
-		// find block to begin writing to
-		union fs_block temp;
-		int chunkSize = BLOCK_SIZE;
-
-		int overallIndex = offset / BLOCK_SIZE; // ensure we get a valid int index
-		while (overallIndex < 5 && bytes_written < length) {
-			if (inode.direct[overallIndex] == 0) {
-				int index = getNextBlock();
+		if (offset < 0 || length < 0) {
+			printf("simplefs: Error! Invalid offset or length.\n");
+			return 0;
+		}
+		if (length == 0) {
+			return 0;
+		}
 
-				if (index == -1)
-				{
-					printf("simplefs: Error! Not enough space left to write to.\n");
-					return -1;
+		// a small file keeps its data in the inode, until a write takes it past what fits
+		if ((inode.flags & INODE_INLINE) || (fs.super.version >= 4 && inode_empty(&inode))) {
+			if (offset + length <= INODE_INLINE_MAX) {
+				memcpy(&inode.data[offset], data, length);
+				inode.flags |= INODE_INLINE;
+				if (offset + length > inode.size) {
+					inode.size = offset + length;
 				}
-				inode.direct[overallIndex] = index;
-				bitmap[overallIndex] = 1;
+
+				pthread_mutex_lock(&fs.lock);
+				readahead_forget(inumber);
+				inode_block_read(blockNumber, block);
+				inode_store(block, fs.super.version, inodeIndex, &inode);
+				disk_write(blockNumber, block->data);
+				pthread_mutex_unlock(&fs.lock);
+				return length;
+			}
+			if ((inode.flags & INODE_INLINE) && !inode_uninline(inumber, blockNumber, inodeIndex, &inode)) {
+				return -1;
 			}
+		}
+
+		// find the blocks to write to
+		if (offset / BLOCK_SIZE >= max_file_blocks()) {
+			printf("simplefs: Error! Offset is beyond the largest possible file.\n");
+			return 0;
+		}
+		int skip = offset % BLOCK_SIZE;
+		int first = offset / BLOCK_SIZE;
+		int nblocks = (skip + length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		if (first + nblocks > max_file_blocks()) {
+			nblocks = max_file_blocks() - first;
+		}
+		if (nblocks <= 0) {
+			printf("simplefs: Error! Offset is beyond the largest possible file.\n");
+			return 0;
+		}
 
-			if (chunkSize + bytes_written > length) {
-				chunkSize = length - bytes_written;
+		if (fs.super.compress) {
+			if (length > nblocks * BLOCK_SIZE - skip) {
+				length = nblocks * BLOCK_SIZE - skip;
+			}
+			// even a write that failed may have given the inode pointer blocks of its own
+			bytes_written = write_clusters(inumber, &inode, data, length, offset);
+			if (bytes_written > 0 && offset + bytes_written > inode.size) {
+				inode.size = offset + bytes_written;
 			}
 
-			strncpy(temp.data, data, chunkSize);
-			data += chunkSize;
+			pthread_mutex_lock(&fs.lock);
+			readahead_forget(inumber);
+			inode_block_read(blockNumber, block);
+			inode_store(block, fs.super.version, inodeIndex, &inode);
+			disk_write(blockNumber, block->data);
+			blocks_sync();
+			pthread_mutex_unlock(&fs.lock);
+			return bytes_written;
+		}
 
-			disk_write(inode.direct[overallIndex], temp.data);
-			inode.size += chunkSize;
-			bytes_written += chunkSize;
-			overallIndex++;
+		int *blocks = malloc(3 * nblocks * sizeof(int));
+		char **bufs = malloc(nblocks * sizeof(char *));
+		if (blocks == NULL || bufs == NULL) {
+			printf("simplefs: Error! Out of memory.\n");
+			free(blocks);
+			free(bufs);
+			return -1;
 		}
+		int *oldblocks = &blocks[nblocks];
+		int *change = &blocks[2 * nblocks];
+		int i, missing = 0;
+		memset(change, 0, nblocks * sizeof(int));
 
-		// still have some data left to write, need indirect blocks
-		if (bytes_written < length) {
-			union fs_block indirect_block;
-			if (inode.indirect == 0) {
-				int index = getNextBlock();
-				if (index == -1) {
-					printf("simplefs: Error! There is no space left to write to.\n");
-					return -1;
+		// with deduplication every whole block is hashed, before taking the lock, to look
+		// for a copy of it on disk. without the memory for the hashes nothing is shared
+		uint64_t *hashes = NULL;
+		if (fs.hashes.entries && (hashes = calloc(nblocks, sizeof(uint64_t))) != NULL) {
+			for (i = 0; i < nblocks; i++) {
+				long long start = (long long)i * BLOCK_SIZE - skip;
+				if (start >= 0 && start + BLOCK_SIZE <= length) {
+					hashes[i] = block_hash(&data[start]);
 				}
+			}
+		}
+
+		// remember what existed before, then allocate anything that is missing. a whole
+		// block of zeros over a hole stays a hole (-1 tells inode_alloc_blocks to skip it),
+		// one already on disk is shared, and one shared with another file gets a new block.
+		// that takes pointer blocks of the file's own, or the counts say nothing about it
+		pthread_mutex_lock(&fs.lock);
+		int unshared = inode_unshare(&inode, first, nblocks);
+		if (unshared && offset > inode.size) {
+			int gapend = inode_span(&inode) < first ? inode_span(&inode) : first;
+			unshared = gap_unshare(inumber, &inode, inode.size / BLOCK_SIZE, gapend);
+		}
+		blockmap_lookup(inumber, &inode, first, nblocks, oldblocks);
+		for (i = 0; i < nblocks; i++) {
+			long long start = (long long)i * BLOCK_SIZE - skip;
+			if (oldblocks[i] == 0 && start >= 0 && start + BLOCK_SIZE <= length && is_zero(&data[start], BLOCK_SIZE)) {
+				oldblocks[i] = -1;
+			}
+			else if (hashes && hashes[i] && (change[i] = dedup_copy(hashes[i], oldblocks[i], &data[start])) > 0) {
+				missing = 1;
+			}
+			else if (oldblocks[i] == 0) {
+				missing = 1;
+			}
+		}
 
-				inode.indirect = index;
-				bitmap[index] = 1;
+		// take the references first: a block this write replaces may be one it goes on to
+		// share, and must not be freed on the way. a block it would overwrite that anything
+		// else points to (maybe since just now) gets a copy of its own
+		for (i = 0; i < nblocks; i++) {
+			if (change[i] > 0 && change[i] != oldblocks[i] && !refs_take(change[i])) {
+				change[i] = 0;
+			}
+		}
+		for (i = 0; i < nblocks; i++) {
+			if (change[i] == 0 && oldblocks[i] > 0 && refs_get(oldblocks[i]) > 0) {
+				change[i] = -1;
+				missing = 1;
+			}
+		}
+		if (missing || !unshared) {
+			int mapped = unshared ? inode_alloc_blocks(&inode, first, nblocks, oldblocks, change, blocks) : 0;
+			for (i = mapped; i < nblocks; i++) {
+				if (change[i] > 0 && change[i] != oldblocks[i]) {
+					releaseBlock(change[i]);
+				}
+			}
+			nblocks = mapped;
+			if (nblocks == 0) {
+				inode_block_read(blockNumber, block);
+				inode_store(block, fs.super.version, inodeIndex, &inode);
+				disk_write(blockNumber, block->data);
+				blocks_sync();
+				pthread_mutex_unlock(&fs.lock);
+				free(blocks);
+				free(bufs);
+				free(hashes);
+				return -1;
+			}
+			blockmap_update(inumber, first, nblocks, blocks);
+		}
+		else {
+			// overwriting blocks that already exist: no need to touch the indirect block
+			memcpy(blocks, oldblocks, nblocks * sizeof(int));
+		}
+		for (i = 0; i < nblocks; i++) {
+			if (hashes && change[i] <= 0 && blocks[i] > 0 && hashes[i]) {
+				hash_record(blocks[i], hashes[i]);
 			}
+			else if (hashes && change[i] <= 0 && blocks[i] > 0) {
+				hash_forget(blocks[i]);
+			}
+		}
+		pthread_mutex_unlock(&fs.lock);
+		free(hashes);
+		if (length > nblocks * BLOCK_SIZE - skip) {
+			length = nblocks * BLOCK_SIZE - skip;
+		}
 
-			disk_read(inode.indirect, indirect_block.data);
+		// a write past the end leaves a gap that must read back as zeros, which blocks
+		// preallocated there do not hold yet. nothing is allocated past the inode's span,
+		// and the gap is looked up an indirect block's worth at a time
+		if (offset > inode.size) {
+			int gapend = inode_span(&inode) < first ? inode_span(&inode) : first;
+			int b = inode.size / BLOCK_SIZE;
+			while (b < gapend) {
+				BLOCK_BUFFER(gapblock);
+				int *gaps = gapblock->pointers;
+				int count = gapend - b < POINTERS_PER_BLOCK ? gapend - b : POINTERS_PER_BLOCK;
+				int g;
 
-			int blockIndex;
-			for (blockIndex = 0; bytes_written < length; blockIndex++) {
-				if (indirect_block.pointers[blockIndex] == 0) {
-					int index = getNextBlock();
-					if (index == -1) {
-						printf("simplefs: Error! Not enough space left to write to.\n");
-						return -1;
+				pthread_mutex_lock(&fs.lock);
+				blockmap_lookup(inumber, &inode, b, count, gaps);
+				for (g = 0; g < count; g++) {
+					if (gaps[g]) {
+						hash_forget(gaps[g]);
 					}
-					inode.direct[overallIndex] = index;
 				}
-				
-				if (chunkSize + bytes_written > length) {
-					chunkSize = length - bytes_written;
+				pthread_mutex_unlock(&fs.lock);
+				for (g = 0; g < count; g++) {
+					if (gaps[g]) {
+						BLOCK_BUFFER(scratch);
+						disk_read(gaps[g], scratch->data);
+						clear_past_eof(scratch->data, b + g, inode.size);
+						disk_write(gaps[g], scratch->data);
+					}
 				}
+				b += count;
+			}
+		}
 
-				strncpy(temp.data, data, chunkSize);
-				data += chunkSize;
+		// whole blocks go straight from the caller's buffer; a partial first or last block
+		// is merged with its old contents (or zeros, if it is new) in a bounce buffer
+		BLOCK_BUFFER(head);
+		BLOCK_BUFFER(tail);
+		int end = (skip + length) % BLOCK_SIZE;
+		int headpartial = skip != 0 || (nblocks == 1 && end != 0);
+		int tailpartial = nblocks > 1 && end != 0;
 
-				disk_write(inode.direct[overallIndex], temp.data);
-				inode.size += chunkSize;
-				bytes_written += chunkSize;
+		if (headpartial) {
+			if (oldblocks[0]) {
+				disk_submit_read(oldblocks[0], 1, head->data);
 			}
+			else {
+				memset(head->data, 0, BLOCK_SIZE);
+			}
+		}
+		if (tailpartial) {
+			if (oldblocks[nblocks - 1]) {
+				disk_submit_read(oldblocks[nblocks - 1], 1, tail->data);
+			}
+			else {
+				memset(tail->data, 0, BLOCK_SIZE);
+			}
+		}
+		disk_wait();
+		if (headpartial) {
+			clear_past_eof(head->data, first, inode.size);
+		}
+		if (tailpartial) {
+			clear_past_eof(tail->data, first + nblocks - 1, inode.size);
+		}
+
+		for (i = headpartial ? 1 : 0; i < nblocks; i++) {
+			bufs[i] = (char *)data + (i * BLOCK_SIZE - skip);
+		}
+		if (headpartial) {
+			int n = BLOCK_SIZE - skip;
+			if (n > length) {
+				n = length;
+			}
+			memcpy(&head->data[skip], data, n);
+			bufs[0] = head->data;
+		}
+		if (tailpartial) {
+			memcpy(tail->data, &data[length - end], end);
+			bufs[nblocks - 1] = tail->data;
+		}
+
+		// queue one write per run of neighbouring blocks, then wait for all of them together.
+		// a block found on disk already is not written at all
+		for (i = 0; i < nblocks; i++) {
+			if (change[i] > 0) {
+				blocks[i] = -1;
+			}
+		}
+		submit_blocks(blocks, bufs, nblocks, 1);
+		disk_wait();
+
+		free(blocks);
+		free(bufs);
+
+		bytes_written = length;
+		if (offset + length > inode.size) {
+			inode.size = offset + length;
 		}
 
-		block.inode[inumber % 128] = inode;
-		disk_write(blockNumber, block.data);
+		// anything fetched ahead for this inode may now be stale. the inode block is read
+		// again, as its other inodes may have changed in the meantime
+		pthread_mutex_lock(&fs.lock);
+		readahead_forget(inumber);
+		inode_block_read(blockNumber, block);
+		inode_store(block, fs.super.version, inodeIndex, &inode);
+		disk_write(blockNumber, block->data);
+		blocks_sync();
+		pthread_mutex_unlock(&fs.lock);
 		return bytes_written;
 	}
 
 	return 0;
 }
+
+static struct fs_writebuffer *writebuf_find(int inumber)
+{
+	int i;
+
+	for (i = 0; i < WRITEBUF_SLOTS; i++) {
+		if (fs.writebufs[i].inumber == inumber) {
+			fs.writebufs[i].lastuse = ++fs.writebufclock;
+			return &fs.writebufs[i];
+		}
+	}
+	return NULL;
+}
+
+// is anything buffered for the inode? takes fs.lock itself
+static int writebuf_pending(int inumber)
+{
+	pthread_mutex_lock(&fs.lock);
+	int pending = writebuf_find(inumber) != NULL;
+	pthread_mutex_unlock(&fs.lock);
+	return pending;
+}
+
+// write inumber's buffer out (allocating its blocks now) and free its slot.
+// the caller holds the inode locked for writing, but not fs.lock.
+static void writebuf_flush(struct fs_writebuffer *wb, int inumber)
+{
+	// the blocks promised to the buffer are this thread's to allocate while writing it out
+	pthread_mutex_lock(&fs.lock);
+	flushreserve = wb->reserved;
+	wb->reserved = 0;
+	pthread_mutex_unlock(&fs.lock);
+
+	int written = write_through(inumber, wb->data, wb->length, wb->offset);
+	if (written != wb->length) {
+		printf("simplefs: Error! Only %d of %d buffered bytes of inode %d could be written.\n", written < 0 ? 0 : written, wb->length, inumber);
+	}
+
+	pthread_mutex_lock(&fs.lock);
+	fs.reserved -= flushreserve;
+	flushreserve = 0;
+	wb->inumber = 0;
+	wb->length = 0;
+	pthread_mutex_unlock(&fs.lock);
+}
+
+static void writebuf_flush_inode(int inumber)
+{
+	pthread_mutex_lock(&fs.lock);
+	struct fs_writebuffer *wb = writebuf_find(inumber);
+	pthread_mutex_unlock(&fs.lock);
+
+	if (wb) {
+		writebuf_flush(wb, inumber);
+	}
+}
+
+// flush every buffer; the caller holds no locks
+static void writebuf_flush_all()
+{
+	int i;
+
+	for (i = 0; i < WRITEBUF_SLOTS; i++) {
+		struct fs_writebuffer *wb = &fs.writebufs[i];
+
+		pthread_mutex_lock(&fs.lock);
+		int inumber = wb->inumber;
+		pthread_mutex_unlock(&fs.lock);
+		if (inumber == 0) {
+			continue;
+		}
+
+		// the slot may have been flushed and reused while we waited for the inode
+		pthread_rwlock_wrlock(inode_lock(inumber));
+		pthread_mutex_lock(&fs.lock);
+		int still = wb->inumber == inumber;
+		pthread_mutex_unlock(&fs.lock);
+		if (still) {
+			writebuf_flush(wb, inumber);
+		}
+		pthread_rwlock_unlock(inode_lock(inumber));
+	}
+}
+
+static void writebuf_release()
+{
+	int i;
+
+	for (i = 0; i < WRITEBUF_SLOTS; i++) {
+		free(fs.writebufs[i].data);
+	}
+	memset(fs.writebufs, 0, sizeof(fs.writebufs));
+	fs.writebufclock = 0;
+	fs.reserved = 0;
+}
+
+static void writebuf_forget(int inumber)
+{
+	struct fs_writebuffer *wb = writebuf_find(inumber);
+	if (wb) {
+		fs.reserved -= wb->reserved;
+		wb->reserved = 0;
+		wb->inumber = 0;
+		wb->length = 0;
+	}
+}
+
+// the size of a file once its buffered writes are in
+static long long writebuf_size(int inumber, long long size)
+{
+	struct fs_writebuffer *wb = writebuf_find(inumber);
+	if (wb && wb->offset + wb->length > size) {
+		return wb->offset + wb->length;
+	}
+	return size;
+}
+
+// the most blocks writing a buffer out can allocate: each data block it covers (new, or
+// a copy of one another file shares), whole clusters on a compressed disk, the first block
+// for data that moves out of the inode, and each pointer block the range reaches, with the
+// ones above it, created or copied
+static int writebuf_need(long long offset, int length)
+{
+	long long first = offset / BLOCK_SIZE;
+	long long last = (offset + length - 1) / BLOCK_SIZE;
+
+	if (fs.super.compress) {
+		first -= first % COMPRESS_CLUSTER;
+		last += COMPRESS_CLUSTER - 1 - last % COMPRESS_CLUSTER;
+	}
+	long long need = last - first + 1;
+	if (first > 0 && fs.super.version >= 4) {
+		need++;
+	}
+	if (last >= POINTERS_PER_INODE) {
+		long long from = first > POINTERS_PER_INODE ? first : POINTERS_PER_INODE;
+		need += 3 * ((last - from) / POINTERS_PER_BLOCK + 2);
+	}
+	return need;
+}
+
+// could a buffer hold [offset, offset+length) and be sure of its blocks once flushed?
+// the caller holds fs.lock
+static int writebuf_fits(long long offset, int length)
+{
+	if (offset + length > (long long)max_file_blocks() * BLOCK_SIZE) {
+		return 0;
+	}
+	return writebuf_need(offset, length) <= blocks_available();
+}
+
+// promise the buffer every block it could need once it holds [offset, offset+length), or
+// return 0 if there is not that much room, or we write through instead. the caller holds fs.lock
+static int writebuf_reserve(struct fs_writebuffer *wb, long long offset, int length)
+{
+	if (offset + length > (long long)max_file_blocks() * BLOCK_SIZE) {
+		return 0;
+	}
+
+	int need = writebuf_need(offset, length);
+	if (need - wb->reserved > blocks_available()) {
+		return 0;
+	}
+	fs.reserved += need - wb->reserved;
+	wb->reserved = need;
+	return 1;
+}
+
+// a free slot for inumber, flushing the least recently used buffer if they are all taken.
+// the caller holds inumber locked for writing, but not fs.lock. a buffer whose inode is
+// busy is left alone, so this gives up (returns NULL) when every one of them is.
+static struct fs_writebuffer *writebuf_claim(int inumber)
+{
+	pthread_mutex_lock(&fs.lock);
+
+	while (1) {
+		struct fs_writebuffer *victim = NULL, *empty = NULL;
+		int i;
+
+		for (i = 0; i < WRITEBUF_SLOTS; i++) {
+			struct fs_writebuffer *wb = &fs.writebufs[i];
+			if (wb->inumber == 0) {
+				empty = wb;
+				break;
+			}
+			if (victim == NULL || wb->lastuse < victim->lastuse) {
+				if (pthread_rwlock_trywrlock(inode_lock(wb->inumber)) == 0) {
+					if (victim) {
+						pthread_rwlock_unlock(inode_lock(victim->inumber));
+					}
+					victim = wb;
+				}
+			}
+		}
+
+		if (empty) {
+			if (victim) {
+				pthread_rwlock_unlock(inode_lock(victim->inumber));
+			}
+			if (empty->data == NULL) {
+				empty->data = malloc(WRITEBUF_SIZE);
+				if (empty->data == NULL) {
+					pthread_mutex_unlock(&fs.lock);
+					return NULL;
+				}
+			}
+			empty->inumber = inumber;
+			empty->offset = 0;
+			empty->length = 0;
+			empty->lastuse = ++fs.writebufclock;
+			pthread_mutex_unlock(&fs.lock);
+			return empty;
+		}
+		if (victim == NULL) {
+			pthread_mutex_unlock(&fs.lock);
+			return NULL;
+		}
+
+		// write the victim out, then look again: another writer may take the slot first
+		int vnumber = victim->inumber;
+		pthread_mutex_unlock(&fs.lock);
+		writebuf_flush(victim, vnumber);
+		pthread_rwlock_unlock(inode_lock(vnumber));
+		pthread_mutex_lock(&fs.lock);
+	}
+}
+
+// fs_write with the inode locked for writing
+static int write_inode( int inumber, const char *data, int length, long long offset, int blockNumber, int index )
+{
+	// small writes are collected in memory, so that many of them reach the disk as
+	// whole blocks with a single inode update; anything else goes straight through
+	if (offset < 0 || length <= 0 || length >= WRITEBUF_SIZE) {
+		writebuf_flush_inode(inumber);
+		return write_through(inumber, data, length, offset);
+	}
+
+	pthread_mutex_lock(&fs.lock);
+	struct fs_writebuffer *wb = writebuf_find(inumber);
+	if (wb) {
+		// extend (or overwrite part of) what is already buffered
+		long long end = offset + length - wb->offset;
+		if (offset >= wb->offset && offset <= wb->offset + wb->length && end <= WRITEBUF_SIZE && writebuf_reserve(wb, wb->offset, end)) {
+			memcpy(&wb->data[offset - wb->offset], data, length);
+			if (end > wb->length) {
+				wb->length = end;
+			}
+			pthread_mutex_unlock(&fs.lock);
+			return length;
+		}
+	}
+	int fits = writebuf_fits(offset, length);
+	pthread_mutex_unlock(&fs.lock);
+
+	if (wb) {
+		writebuf_flush(wb, inumber);
+	}
+
+	// only start buffering for an inode that exists and a write that will fit
+	BLOCK_BUFFER(block);
+	inode_block_read(blockNumber, block);
+	struct fs_inode inode;
+	inode_load(block, fs.super.version, index, &inode);
+	if (!fits || !inode.isvalid) {
+		return write_through(inumber, data, length, offset);
+	}
+
+	wb = writebuf_claim(inumber);
+	if (wb == NULL) {
+		return write_through(inumber, data, length, offset);
+	}
+
+	// the room seen before may have gone to someone else since
+	pthread_mutex_lock(&fs.lock);
+	if (!writebuf_reserve(wb, offset, length)) {
+		wb->inumber = 0;
+		pthread_mutex_unlock(&fs.lock);
+		return write_through(inumber, data, length, offset);
+	}
+	wb->offset = offset;
+	wb->length = length;
+	memcpy(wb->data, data, length);
+	pthread_mutex_unlock(&fs.lock);
+	return length;
+}
+
+int fs_write( int inumber, const char *data, int length, long long offset )
+{
+	if (!fs.mounted) {
+		printf("simplefs: Error! No mounted disk.\n");
+		return -1;
+	}
+
+	int blockNumber, index;
+	if (!inode_locate(inumber, &blockNumber, &index)) {
+		printf("simplefs: Error! Invalid inumber.\n");
+		return 0;
+	}
+
+	pthread_rwlock_wrlock(inode_lock(inumber));
+	int result = write_inode(inumber, data, length, offset, blockNumber, index);
+	pthread_rwlock_unlock(inode_lock(inumber));
+	return result;
+}
+
+// fs_fallocate with the inode locked for writing and fs.lock held
+static int fallocate_inode( int inumber, int blockNumber, int index, long long offset, long long length )
+{
+	BLOCK_BUFFER(block);
+	inode_block_read(blockNumber, block);
+	struct fs_inode inode;
+	inode_load(block, fs.super.version, index, &inode);
+	if (!inode.isvalid) {
+		printf("simplefs: Error! Invalid inode.\n");
+		return 0;
+	}
+
+	int first = offset / BLOCK_SIZE;
+	int end = size_to_blocks(offset + length);
+	if (fs.super.compress) {
+		// only whole clusters are allocated; a partly allocated one would read as compressed
+		first -= first % COMPRESS_CLUSTER;
+		end += (COMPRESS_CLUSTER - end % COMPRESS_CLUSTER) % COMPRESS_CLUSTER;
+	}
+	int nblocks = end - first;
+	int *blocks = malloc(2 * nblocks * sizeof(int));
+	if (blocks == NULL) {
+		printf("simplefs: Error! Out of memory.\n");
+		return 0;
+	}
+
+	// make sure everything fits before claiming anything
+	int *oldblocks = &blocks[nblocks];
+	int i, missing = 0;
+	blockmap_lookup(inumber, &inode, first, nblocks, oldblocks);
+	if (fs.super.compress) {
+		// a compressed cluster already holds its data, and keeps the pointers it does not use free
+		for (i = 0; i < nblocks; i += COMPRESS_CLUSTER) {
+			int used = cluster_blocks(&oldblocks[i]), j;
+			for (j = used; used > 0 && j < COMPRESS_CLUSTER; j++) {
+				oldblocks[i + j] = -1;
+			}
+		}
+	}
+	for (i = 0; i < nblocks; i++) {
+		if (oldblocks[i] == 0) {
+			missing++;
+		}
+	}
+	missing += pointer_blocks_missing(&inode, first, nblocks);
+	if (missing > blocks_available()) {
+		printf("simplefs: Error! Not enough free blocks to preallocate %lld bytes.\n", length);
+		free(blocks);
+		return 0;
+	}
+
+	if (missing > 0) {
+		nblocks = inode_alloc_blocks(&inode, first, nblocks, oldblocks, NULL, blocks);
+		blockmap_update(inumber, first, nblocks, blocks);
+
+		// blocks filling a hole inside the file must read back as the zeros it did
+		BLOCK_BUFFER(zero);
+		memset(zero->data, 0, BLOCK_SIZE);
+		for (i = 0; i < nblocks && (long long)(first + i) * BLOCK_SIZE < inode.size; i++) {
+			if (oldblocks[i] == 0) {
+				disk_write(blocks[i], zero->data);
+			}
+		}
+		inode_store(block, fs.super.version, index, &inode);
+		disk_write(blockNumber, block->data);
+		blocks_sync();
+	}
+
+	free(blocks);
+	return 1;
+}
+
+int fs_fallocate( int inumber, long long offset, long long length )
+{
+	if (!fs.mounted) {
+		printf("simplefs: Error! No mounted disk.\n");
+		return 0;
+	}
+
+	int blockNumber, index;
+	if (!inode_locate(inumber, &blockNumber, &index)) {
+		printf("simplefs: Error! Invalid inumber.\n");
+		return 0;
+	}
+	if (offset < 0 || length <= 0 || offset + length > (long long)max_file_blocks() * BLOCK_SIZE) {
+		printf("simplefs: Error! Invalid offset or length.\n");
+		return 0;
+	}
+
+	// buffered writes allocate their blocks first, so nothing is counted twice
+	pthread_rwlock_wrlock(inode_lock(inumber));
+	writebuf_flush_inode(inumber);
+
+	// a small file needs no blocks while its data fits in the inode; past that an inline
+	// file's data moves out to a block first
+	BLOCK_BUFFER(block);
+	struct fs_inode inode;
+	pthread_mutex_lock(&fs.lock);
+	inode_block_read(blockNumber, block);
+	inode_load(block, fs.super.version, index, &inode);
+	pthread_mutex_unlock(&fs.lock);
+	if (inode.isvalid && ((inode.flags & INODE_INLINE) || (fs.super.version >= 4 && inode_empty(&inode)))) {
+		if (offset + length <= INODE_INLINE_MAX) {
+			pthread_rwlock_unlock(inode_lock(inumber));
+			return 1;
+		}
+		if ((inode.flags & INODE_INLINE) && !inode_uninline(inumber, blockNumber, index, &inode)) {
+			pthread_rwlock_unlock(inode_lock(inumber));
+			return 0;
+		}
+	}
+
+	pthread_mutex_lock(&fs.lock);
+	int result = fallocate_inode(inumber, blockNumber, index, offset, length);
+	pthread_mutex_unlock(&fs.lock);
+	pthread_rwlock_unlock(inode_lock(inumber));
+	return result;
+}
@@ -1,15 +1,44 @@
 #ifndef FS_H
 #define FS_H
 
+// fs_format, fs_mount and fs_unmount must not overlap with any other call;
+// the rest may be used from several threads at once.
 void fs_debug();
 int  fs_format();
 int  fs_mount();
+int  fs_unmount();
+void fs_sync();
+
+// whether fs_format stores file data compressed, a few blocks at a time (off unless set)
+void fs_compress_config( int enable );
+
+// whether fs_format sets the disk up to keep identical blocks once (off unless set)
+void fs_dedup_config( int enable );
+
+// worker threads for the inode table scans in fs_mount and fs_debug; 0 means one per processor
+void fs_scan_config( int nthreads );
 
 int  fs_create();
 int  fs_delete( int inumber );
-int  fs_getsize();
 
-int  fs_read( int inumber, char *data, int length, int offset );
-int  fs_write( int inumber, const char *data, int length, int offset );
+// a new inode with the same contents as inumber, sharing its blocks until either is written;
+// returns its number, or 0. takes the same time for a file of any size
+int  fs_clone( int inumber );
+
+long long fs_getsize();
+
+int  fs_read( int inumber, char *data, int length, long long offset );
+int  fs_write( int inumber, const char *data, int length, long long offset );
+
+// allocate the blocks behind [offset, offset+length) without changing the file size
+int  fs_fallocate( int inumber, long long offset, long long length );
+
+// check that the inode pointers, sizes and both bitmaps agree, and fix what does not if repair
+// is set; returns the number of problems found, or -1. must not overlap with any other call.
+int  fs_fsck( int repair );
+
+// the blocks saved by files sharing blocks, and the memory the deduplication index takes;
+// returns 0 unless a disk formatted for deduplication is mounted
+int  fs_dedup_stats( long long *savedblocks, long long *indexbytes );
 
 #endif
@@ -0,0 +1,149 @@
+
+#include <string.h>
+#include <stdint.h>
+
+#include "lz.h"
+
+/*
+The compressed data is a series of sequences. Each starts with a token byte:
+the high four bits count the literals that follow it, the low four bits the
+length of the match after them, less LZ_MIN_MATCH. A count of 15 goes on in
+extra bytes, each added to it, until one is less than 255. The literals come
+next, then the match offset in two bytes, least significant first, then the
+extra match length bytes. The last sequence stops after its literals.
+*/
+
+#define LZ_MIN_MATCH  4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS  12	// entries in the match finder's table of recent positions
+#define LZ_SKIP_SHIFT 6		// look further apart the longer nothing has matched
+
+static uint32_t read32( const unsigned char *p )
+{
+	uint32_t v;
+	memcpy(&v,p,4);
+	return v;
+}
+
+static int hash32( uint32_t v )
+{
+	return (v*2654435761u)>>(32-LZ_HASH_BITS);
+}
+
+static unsigned char *put_count( unsigned char *out, int count )
+{
+	while(count>=255) {
+		*out++ = 255;
+		count -= 255;
+	}
+	*out++ = count;
+	return out;
+}
+
+// append one sequence; returns the new end of the output, or 0 if it does not fit
+static unsigned char *put_sequence( unsigned char *out, unsigned char *end, const unsigned char *literals, int nliterals, int offset, int matchlen )
+{
+	int extra = matchlen ? matchlen-LZ_MIN_MATCH : 0;
+	long need = 1 + nliterals/255 + 1 + nliterals + 2 + extra/255 + 1;
+
+	if(end-out<need) return 0;
+
+	*out++ = (nliterals<15 ? nliterals : 15)<<4 | (extra<15 ? extra : 15);
+	if(nliterals>=15) out = put_count(out,nliterals-15);
+	memcpy(out,literals,nliterals);
+	out += nliterals;
+
+	if(matchlen) {
+		*out++ = offset&0xff;
+		*out++ = offset>>8;
+		if(extra>=15) out = put_count(out,extra-15);
+	}
+	return out;
+}
+
+int lz_compress( const char *source, int n, char *dest, int cap )
+{
+	const unsigned char *src = (const unsigned char *)source;
+	unsigned char *out = (unsigned char *)dest;
+	unsigned char *end = out+cap;
+	int table[1<<LZ_HASH_BITS];
+	int anchor = 0, pos = 0;
+
+	memset(table,0xff,sizeof(table));
+
+	while(pos+LZ_MIN_MATCH<=n) {
+		uint32_t v = read32(&src[pos]);
+		int h = hash32(v);
+		int ref = table[h];
+
+		table[h] = pos;
+		if(ref<0 || pos-ref>LZ_MAX_OFFSET || read32(&src[ref])!=v) {
+			pos += 1+((pos-anchor)>>LZ_SKIP_SHIFT);
+			continue;
+		}
+
+		int len = LZ_MIN_MATCH;
+		while(pos+len<n && src[ref+len]==src[pos+len]) len++;
+
+		out = put_sequence(out,end,&src[anchor],pos-anchor,pos-ref,len);
+		if(!out) return 0;
+		pos += len;
+		anchor = pos;
+	}
+
+	out = put_sequence(out,end,&src[anchor],n-anchor,0,0);
+	if(!out) return 0;
+	return out-(unsigned char *)dest;
+}
+
+// read an extended count; returns 0 if the input ends first
+static const unsigned char *get_count( const unsigned char *in, const unsigned char *end, int *count )
+{
+	int b;
+
+	do {
+		if(in>=end) return 0;
+		b = *in++;
+		*count += b;
+	} while(b==255);
+	return in;
+}
+
+int lz_decompress( const char *source, int n, char *dest, int cap )
+{
+	const unsigned char *in = (const unsigned char *)source;
+	const unsigned char *inend = in+n;
+	unsigned char *out = (unsigned char *)dest;
+	unsigned char *outend = out+cap;
+
+	while(in<inend) {
+		int token = *in++;
+		int nliterals = token>>4;
+		int len = (token&15)+LZ_MIN_MATCH;
+
+		if(nliterals==15 && !(in = get_count(in,inend,&nliterals))) return -1;
+		if(nliterals>inend-in || nliterals>outend-out) return -1;
+		memcpy(out,in,nliterals);
+		in += nliterals;
+		out += nliterals;
+
+		if(in==inend) break;
+
+		if(inend-in<2) return -1;
+		int offset = in[0] | in[1]<<8;
+		in += 2;
+		if((token&15)==15 && !(in = get_count(in,inend,&len))) return -1;
+		if(offset==0 || offset>out-(unsigned char *)dest || len>outend-out) return -1;
+
+		// a match may overlap the bytes it produces, so only a distant one is one memcpy
+		const unsigned char *match = out-offset;
+		if(offset>=len) {
+			memcpy(out,match,len);
+			out += len;
+		} else {
+			while(len-->0) *out++ = *match++;
+		}
+	}
+
+	return out-(unsigned char *)dest;
+}
@@ -0,0 +1,15 @@
+#ifndef LZ_H
+#define LZ_H
+
+// a small LZ77 codec in the style of LZ4: runs of literals and back references of at
+// least four bytes, at most 65535 bytes back.
+
+// compress n bytes of src into dst; returns the compressed size, or 0 if that would
+// take more than cap bytes
+int lz_compress( const char *src, int n, char *dst, int cap );
+
+// undo lz_compress; returns the size of the data, or -1 if src is not valid compressed
+// data of at most cap bytes
+int lz_decompress( const char *src, int n, char *dst, int cap );
+
+#endif
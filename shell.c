@@ -6,6 +6,8 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 static int do_copyin( const char *filename, int inumber );
 static int do_copyout( int inumber, const char *filename );
@@ -16,19 +18,45 @@ int main( int argc, char *argv[] )
 	char cmd[1024];
 	char arg1[1024];
 	char arg2[1024];
-	int inumber, result, args;
+	int inumber, result, args, opt;
+	long long size;
+	int backend = DISK_BACKEND_FILE;
 
-	if(argc!=3) {
-		printf("use: %s <diskfile> <nblocks>\n",argv[0]);
+	while((opt=getopt(argc,argv,"b:c:mu:t:"))!=-1) {
+		switch(opt) {
+			case 'b':
+				disk_block_size_config(atoi(optarg));
+				break;
+			case 'c':
+				disk_cache_config(atoi(optarg));
+				break;
+			case 'm':
+				backend = DISK_BACKEND_MMAP;
+				break;
+			case 'u':
+				backend = DISK_BACKEND_URING;
+				disk_uring_config(atoi(optarg));
+				break;
+			case 't':
+				fs_scan_config(atoi(optarg));
+				break;
+			default:
+				printf("use: %s [-b <blocksize>] [-c <cacheblocks>] [-m | -u <queuedepth>] [-t <scanthreads>] <diskfile> <nblocks>\n",argv[0]);
+				return 1;
+		}
+	}
+
+	if(argc-optind!=2) {
+		printf("use: %s [-b <blocksize>] [-c <cacheblocks>] [-m | -u <queuedepth>] [-t <scanthreads>] <diskfile> <nblocks>\n",argv[0]);
 		return 1;
 	}
 
-	if(!disk_init(argv[1],atoi(argv[2]))) {
-		printf("couldn't initialize %s: %s\n",argv[1],strerror(errno));
+	if(!disk_init_backend(argv[optind],atoi(argv[optind+1]),backend)) {
+		printf("couldn't initialize %s: %s\n",argv[optind],strerror(errno));
 		return 1;
 	}
 
-	printf("opened emulated disk image %s with %d blocks\n",argv[1],disk_size());
+	printf("opened emulated disk image %s with %d blocks\n",argv[optind],disk_size());
 
 	while(1) {
 		printf(" simplefs> ");
@@ -43,14 +71,16 @@ int main( int argc, char *argv[] )
 		if(args==0) continue;
 
 		if(!strcmp(cmd,"format")) {
-			if(args==1) {
+			if(args==1 || (args==2 && (!strcmp(arg1,"compress") || !strcmp(arg1,"dedup")))) {
+				fs_compress_config(args==2 && !strcmp(arg1,"compress"));
+				fs_dedup_config(args==2 && !strcmp(arg1,"dedup"));
 				if(fs_format()) {
 					printf("disk formatted.\n");
 				} else {
 					printf("format failed!\n");
 				}
 			} else {
-				printf("use: format\n");
+				printf("use: format [compress|dedup]\n");
 			}
 		} else if(!strcmp(cmd,"mount")) {
 			if(args==1) {
@@ -62,6 +92,16 @@ int main( int argc, char *argv[] )
 			} else {
 				printf("use: mount\n");
 			}
+		} else if(!strcmp(cmd,"unmount")) {
+			if(args==1) {
+				if(fs_unmount()) {
+					printf("disk unmounted.\n");
+				} else {
+					printf("unmount failed!\n");
+				}
+			} else {
+				printf("use: unmount\n");
+			}
 		} else if(!strcmp(cmd,"debug")) {
 			if(args==1) {
 				fs_debug();
@@ -71,9 +111,9 @@ int main( int argc, char *argv[] )
 		} else if(!strcmp(cmd,"getsize")) {
 			if(args==2) {
 				inumber = atoi(arg1);
-				result = fs_getsize(inumber);
-				if(result>=0) {
-					printf("inode %d has size %d\n",inumber,result);
+				size = fs_getsize(inumber);
+				if(size>=0) {
+					printf("inode %d has size %lld\n",inumber,size);
 				} else {
 					printf("getsize failed!\n");
 				}
@@ -103,6 +143,18 @@ int main( int argc, char *argv[] )
 			} else {
 				printf("use: delete <inumber>\n");
 			}
+		} else if(!strcmp(cmd,"clone")) {
+			if(args==2) {
+				inumber = atoi(arg1);
+				int clone = fs_clone(inumber);
+				if(clone>0) {
+					printf("inode %d cloned to inode %d\n",inumber,clone);
+				} else {
+					printf("clone failed!\n");
+				}
+			} else {
+				printf("use: clone <inumber>\n");
+			}
 		} else if(!strcmp(cmd,"cat")) {
 			if(args==2) {
 				inumber = atoi(arg1);
@@ -137,16 +189,56 @@ int main( int argc, char *argv[] )
 				printf("use: copyout <inumber> <filename>\n");
 			}
 
+		} else if(!strcmp(cmd,"sync")) {
+			if(args==1) {
+				fs_sync();
+				printf("disk synced.\n");
+			} else {
+				printf("use: sync\n");
+			}
+
+		} else if(!strcmp(cmd,"fsck")) {
+			if(args==1 || (args==2 && !strcmp(arg1,"repair"))) {
+				result = fs_fsck(args==2);
+				if(result==0) {
+					printf("no problems found.\n");
+				} else if(result>0) {
+					printf("%d problems found%s.\n",result,args==2 ? " and repaired" : "");
+				} else {
+					printf("fsck failed!\n");
+				}
+			} else {
+				printf("use: fsck [repair]\n");
+			}
+
+		} else if(!strcmp(cmd,"dedup")) {
+			if(args==1) {
+				long long saved, indexbytes;
+				if(fs_dedup_stats(&saved,&indexbytes)) {
+					printf("%lld blocks (%lld bytes) saved by sharing\n",saved,saved*disk_block_size());
+					printf("deduplication index uses %lld bytes of memory\n",indexbytes);
+				} else {
+					printf("dedup failed!\n");
+				}
+			} else {
+				printf("use: dedup\n");
+			}
+
 		} else if(!strcmp(cmd,"help")) {
 			printf("Commands are:\n");
-			printf("    format\n");
+			printf("    format  [compress|dedup]\n");
 			printf("    mount\n");
+			printf("    unmount\n");
 			printf("    debug\n");
 			printf("    create\n");
 			printf("    delete  <inode>\n");
+			printf("    clone   <inode>\n");
 			printf("    cat     <inode>\n");
 			printf("    copyin  <file> <inode>\n");
 			printf("    copyout <inode> <file>\n");
+			printf("    sync\n");
+			printf("    fsck    [repair]\n");
+			printf("    dedup\n");
 			printf("    help\n");
 			printf("    quit\n");
 			printf("    exit\n");
@@ -161,6 +253,8 @@ int main( int argc, char *argv[] )
 		}
 	}
 
+	fs_unmount();
+
 	printf("closing emulated disk.\n");
 	disk_close();
 
@@ -170,8 +264,10 @@ int main( int argc, char *argv[] )
 static int do_copyin( const char *filename, int inumber )
 {
 	FILE *file;
-	int offset=0, result, actual;
+	long long offset=0;
+	int result, actual;
 	char buffer[16384];
+	struct stat info;
 
 	file = fopen(filename,"r");
 	if(!file) {
@@ -179,6 +275,15 @@ static int do_copyin( const char *filename, int inumber )
 		return 0;
 	}
 
+	// when the size is known up front, claim all the blocks at once (and fail now if they don't fit).
+	// a sparse file is not: fs_write leaves its runs of zeros as holes
+	if(fstat(fileno(file),&info)==0 && S_ISREG(info.st_mode) && info.st_size>0 && (long long)info.st_blocks*512>=info.st_size) {
+		if(!fs_fallocate(inumber,0,info.st_size)) {
+			fclose(file);
+			return 0;
+		}
+	}
+
 	while(1) {
 		result = fread(buffer,1,sizeof(buffer),file);
 		if(result<=0) break;
@@ -196,7 +301,7 @@ static int do_copyin( const char *filename, int inumber )
 		}
 	}
 
-	printf("%d bytes copied\n",offset);
+	printf("%lld bytes copied\n",offset);
 
 	fclose(file);
 	return 1;
@@ -205,7 +310,8 @@ static int do_copyin( const char *filename, int inumber )
 static int do_copyout( int inumber, const char *filename )
 {
 	FILE *file;
-	int offset=0, result;
+	long long offset=0;
+	int result;
 	char buffer[16384];
 
 	file = fopen(filename,"w");
@@ -221,7 +327,7 @@ static int do_copyout( int inumber, const char *filename )
 		offset += result;
 	}
 
-	printf("%d bytes copied\n",offset);
+	printf("%lld bytes copied\n",offset);
 
 	fclose(file);
 	return 1;